@@ -3,24 +3,341 @@
 #include "hw/loader.h"
 #include "hw/sysbus.h"
 #include "hw/arm/arm.h"
+#include "hw/arm/gba.h"
 #include "exec/address-spaces.h"
+#include "qemu/timer.h"
+#include "sysemu/cpus.h"
 #include "sysemu/sysemu.h"
 
 
+#define BAD_REG_OFS_R \
+    printf("%s: Bad register offset 0x%x\n", __func__, (int)offset)
+
+#define BAD_REG_OFS_W \
+    printf("%s: Bad register offset 0x%x (tried to write 0x%04x, " \
+           "mask 0x%04x)\n", __func__, (int)offset, value, mask)
+
+
+static uint16_t gba_io_read_reg(gba_io_state *s, hwaddr offset)
+{
+    const gba_io_handler *h = &s->handlers[offset >> 1];
+
+    if (h->read) {
+        return h->read(h->opaque, offset);
+    }
+
+    if (!h->mapped) {
+        BAD_REG_OFS_R;
+    }
+
+    return s->regs[offset >> 1];
+}
+
+static void gba_io_write_reg(gba_io_state *s, hwaddr offset, uint16_t value,
+                             uint16_t mask)
+{
+    const gba_io_handler *h = &s->handlers[offset >> 1];
+
+    if (h->write) {
+        h->write(h->opaque, offset, value, mask);
+    } else if (h->mapped) {
+        s->regs[offset >> 1] = gba_io_merge(s, offset, value, mask);
+    } else {
+        BAD_REG_OFS_W;
+    }
+}
+
+
+/*
+ * A naturally aligned byte access hits one half of a register, a word access
+ * covers two registers. Unaligned accesses may span register boundaries in
+ * any way, so they are split into byte accesses.
+ */
+
+static uint64_t gba_io_read_access(gba_io_state *s, hwaddr offset,
+                                   unsigned size)
+{
+    if (offset & (size - 1)) {
+        uint64_t value = 0;
+        unsigned i;
+
+        for (i = 0; (i < size) && (offset + i < GBA_IO_SIZE); i++) {
+            value |= gba_io_read_access(s, offset + i, 1) << (i * 8);
+        }
+        return value;
+    }
+
+    switch (size) {
+        case 1:
+            return (gba_io_read_reg(s, offset & ~1) >> ((offset & 1) * 8))
+                   & 0xff;
+        case 2:
+            return gba_io_read_reg(s, offset);
+        default:
+            return gba_io_read_reg(s, offset)
+                 | ((uint32_t)gba_io_read_reg(s, offset + 2) << 16);
+    }
+}
+
+/*
+ * Idle loop detection: A guest reading the same pollable register over and
+ * over again without getting a different value (and without touching any
+ * other register in between) is most likely just waiting for it to change.
+ * Instead of letting it spin, halt the CPU until the value does change or an
+ * interrupt arrives.
+ *
+ * Halting only saves host CPU time: Even with -icount, QEMU advances the
+ * virtual clock by the host time that passed while the CPU slept. With
+ * -global gba_io.fast-forward=on (and -icount), the time until the next event
+ * is skipped instead, both here and in HALT/STOP, so the guest runs as fast as
+ * the host allows rather than in real time.
+ */
+
+#define GBA_IO_POLL_THRESHOLD 16
+
+static void gba_io_check_poll(gba_io_state *s, hwaddr offset, unsigned size,
+                              uint64_t value)
+{
+    if ((offset & (size - 1)) || !s->handlers[offset >> 1].pollable ||
+        ((size == 4) && !s->handlers[(offset >> 1) + 1].pollable))
+    {
+        s->poll_count = 0;
+        return;
+    }
+
+    if ((offset != s->poll_offset) || (size != s->poll_size) ||
+        (value != s->poll_value))
+    {
+        s->poll_offset = offset;
+        s->poll_size   = size;
+        s->poll_value  = value;
+        s->poll_count  = 0;
+        return;
+    }
+
+    if (++s->poll_count >= GBA_IO_POLL_THRESHOLD) {
+        s->poll_count = 0;
+        s->idle = true;
+        cpu_interrupt(CPU(s->cpu), CPU_INTERRUPT_HALT);
+    }
+}
+
+static void gba_io_idle_check(gba_io_state *s)
+{
+    // Pollable registers have no read handlers, so this has no side effects
+    if (gba_io_read_access(s, s->poll_offset, s->poll_size) != s->poll_value) {
+        s->idle = false;
+        cpu_interrupt(CPU(s->cpu), CPU_INTERRUPT_EXITTB);
+    }
+}
+
+
+static uint64_t gba_io_read(void *opaque, hwaddr offset, unsigned size)
+{
+    gba_io_state *s = (gba_io_state *)opaque;
+
+    // Obviously, the CPU is running (again)
+    s->idle = false;
+
+    uint64_t value = gba_io_read_access(s, offset, size);
+
+    if (s->idle_detect) {
+        gba_io_check_poll(s, offset, size, value);
+    }
+
+    return value;
+}
+
+static void gba_io_write(void *opaque, hwaddr offset, uint64_t value,
+                         unsigned size)
+{
+    gba_io_state *s = (gba_io_state *)opaque;
+
+    s->idle = false;
+    s->poll_count = 0;
+
+    if (offset & (size - 1)) {
+        unsigned i;
+
+        for (i = 0; (i < size) && (offset + i < GBA_IO_SIZE); i++) {
+            gba_io_write(s, offset + i, (value >> (i * 8)) & 0xff, 1);
+        }
+        return;
+    }
+
+    switch (size) {
+        case 1:
+            gba_io_write_reg(s, offset & ~1, value << ((offset & 1) * 8),
+                             0xff << ((offset & 1) * 8));
+            break;
+        case 2:
+            gba_io_write_reg(s, offset, value, 0xffff);
+            break;
+        default:
+            gba_io_write_reg(s, offset,     value,       0xffff);
+            gba_io_write_reg(s, offset + 2, value >> 16, 0xffff);
+            break;
+    }
+}
+
+
+static const MemoryRegionOps gba_io_ops = {
+    .read = gba_io_read,
+    .write = gba_io_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+        .unaligned = true,
+    },
+};
+
+static int gba_io_init(SysBusDevice *dev)
+{
+    gba_io_state *s = FROM_SYSBUS(gba_io_state, dev);
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &gba_io_ops, s, "gba-io",
+                          GBA_IO_SIZE);
+    sysbus_init_mmio(dev, &s->iomem);
+
+    s->idle_check = gba_io_idle_check;
+
+    if (s->fast_forward) {
+        if (!use_icount) {
+            fprintf(stderr, "gba_io: fast-forward has no effect without "
+                    "-icount\n");
+        }
+        icount_sleep = false;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Interrupt sources latch their IF bit on the rising edge of their line, just
+ * like on the real hardware; lines staying high (or being raised again) have
+ * no effect. Outputs are only propagated when they actually change, so a
+ * burst of events from one device callback results in at most one transition
+ * on the CPU's IRQ line.
+ *
+ * With the irq-stats property set, the PIC counts raises and acknowledgements
+ * per source, and measures the time (in CPU cycles) from an interrupt becoming
+ * deliverable (its IF and IE bits and IME all set) to the guest's IRQ handler
+ * reading IF for the first time afterwards (or acknowledging it, whichever
+ * comes first). IF reads and acknowledgements only count for interrupts that
+ * are deliverable at that point, so polling IF with interrupts disabled does
+ * not produce samples. The results can be read from the irq-stats-report QOM
+ * property.
+ */
+
+#define GBA_IRQ_SOURCES 14
+
+static const char *const gba_irq_names[GBA_IRQ_SOURCES] = {
+    "vblank", "hblank", "vcount", "timer0", "timer1", "timer2", "timer3",
+    "serial", "dma0", "dma1", "dma2", "dma3", "keypad", "gamepak",
+};
+
+typedef struct gba_irq_stats {
+    uint64_t raises, acks;
+    uint64_t latency_samples, latency_total, latency_max;
+    int64_t pending_since; // -1 if no latency measurement is pending
+} gba_irq_stats;
+
 typedef struct gba_pic_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
+    void *io;
     bool master;
+    uint32_t input;
     uint32_t level;
     uint32_t irq_enabled;
-    uint32_t waitcnt;
     qemu_irq parent_irq;
+    qemu_irq wake_irq;
+
+    bool parent_level;
+    uint32_t wake_pending;
+
+    bool stats_enabled;
+    uint32_t stats_deliverable; // As of the last update
+    gba_irq_stats stats[GBA_IRQ_SOURCES];
 } gba_pic_state;
 
 
+static int64_t gba_pic_now(void)
+{
+    return muldiv64(qemu_get_clock_ns(vm_clock), GBA_CPU_FREQ,
+                    get_ticks_per_sec());
+}
+
+/* Starts measuring for every interrupt that has just become deliverable */
+static void gba_pic_stats_deliverable(gba_pic_state *s, uint32_t irqs)
+{
+    uint32_t started = irqs & ~s->stats_deliverable;
+    int i;
+
+    s->stats_deliverable = irqs;
+    if (!started) {
+        return;
+    }
+
+    int64_t now = gba_pic_now();
+    for (i = 0; i < GBA_IRQ_SOURCES; i++) {
+        if (started & (1 << i)) {
+            s->stats[i].pending_since = now;
+        }
+    }
+}
+
+/* Books the latency of those of irqs that are deliverable right now */
+static void gba_pic_stats_entered(gba_pic_state *s, uint32_t irqs)
+{
+    int64_t now = gba_pic_now();
+    int i;
+
+    if (!s->master) {
+        return;
+    }
+    irqs &= s->level & s->irq_enabled;
+
+    for (i = 0; i < GBA_IRQ_SOURCES; i++) {
+        gba_irq_stats *st = &s->stats[i];
+
+        if (!(irqs & (1 << i)) || (st->pending_since < 0)) {
+            continue;
+        }
+
+        uint64_t latency = now - st->pending_since;
+        st->latency_samples++;
+        st->latency_total += latency;
+        st->latency_max = MAX(st->latency_max, latency);
+        st->pending_since = -1;
+    }
+}
+
+
 static void gba_pic_update(gba_pic_state *s)
 {
-    qemu_set_irq(s->parent_irq, s->master && (s->level & s->irq_enabled));
+    uint32_t pending = s->level & s->irq_enabled;
+    bool parent_level = s->master && pending;
+
+    gba_io_set(s->io, 0x202, s->level); // IF
+
+    if (parent_level != s->parent_level) {
+        s->parent_level = parent_level;
+        qemu_set_irq(s->parent_irq, parent_level);
+    }
+
+    if (unlikely(s->stats_enabled)) {
+        gba_pic_stats_deliverable(s, s->master ? pending : 0);
+    }
+
+    // HALT and STOP end on any enabled interrupt, regardless of IME. Which
+    // ones are pending matters (STOP only ends on some), so any change in the
+    // set is propagated, even if the line stays high.
+    if (pending != s->wake_pending) {
+        s->wake_pending = pending;
+        qemu_set_irq(s->wake_irq, pending);
+    }
 }
 
 
@@ -28,85 +345,96 @@ static void gba_pic_set_irq(void *opaque, int irq, int level)
 {
     gba_pic_state *s = (gba_pic_state *)opaque;
 
-    if (level) {
-        s->level |=   1 << irq;
-    } else {
-        s->level &= ~(1 << irq);
+    if (!level) {
+        s->input &= ~(1 << irq);
+        return;
     }
 
-    gba_pic_update(s);
-}
+    if (s->input & (1 << irq)) {
+        return;
+    }
 
+    s->input |= 1 << irq;
 
-#define CHECK_WIDTH_MAX(expected) \
-    if (size > expected) { \
-        printf("%s: Bad access size %u (on register 0x%x)\n", \
-               __func__, size, (int)offset); \
+    if (unlikely(s->stats_enabled) && (irq < GBA_IRQ_SOURCES)) {
+        s->stats[irq].raises++;
     }
 
-#define BAD_REG_OFS_R \
-    printf("%s: Bad register offset 0x%x\n", __func__, (int)offset)
+    s->level |= 1 << irq;
+    gba_pic_update(s);
+}
 
-#define BAD_REG_OFS_W \
-    printf("%s: Bad register offset 0x%x (tried to write 0x%0*" PRIx64 ")\n", \
-           __func__, (int)offset, size * 2, value)
 
-static uint64_t gba_pic_read(void *opaque, hwaddr offset, unsigned size)
+static void gba_pic_reset(DeviceState *dev)
 {
-    gba_pic_state *s = (gba_pic_state *)opaque;
+    gba_pic_state *s = FROM_SYSBUS(gba_pic_state, SYS_BUS_DEVICE(dev));
+    int i;
 
-    switch (offset) {
-        case 0: // IE
-            CHECK_WIDTH_MAX(4);
-            if (size == 2) {
-                return s->irq_enabled;
-            } else {
-                return s->irq_enabled | (s->level << 16);
-            }
-        case 2: // IF
-            CHECK_WIDTH_MAX(2);
-            return s->level;
-        case 4: // WAITCNT
-            CHECK_WIDTH_MAX(4);
-            return s->waitcnt;
-        case 8: // IME
-            CHECK_WIDTH_MAX(4);
-            return !s->master;
+    s->master = false;
+    s->input = 0;
+    s->level = 0;
+    s->irq_enabled = 0;
 
-        default:
-            BAD_REG_OFS_R;
-            return 0;
+    // The CPU has been reset as well, so its IRQ line is low again
+    s->parent_level = false;
+    s->wake_pending = 0;
+
+    s->stats_deliverable = 0;
+    for (i = 0; i < GBA_IRQ_SOURCES; i++) {
+        s->stats[i].pending_since = -1;
     }
 }
 
 
-static void gba_pic_write(void *opaque, hwaddr offset, uint64_t value,
-                          unsigned size)
+static uint16_t gba_pic_read(void *opaque, hwaddr offset)
+{
+    gba_pic_state *s = (gba_pic_state *)opaque;
+
+    // Only registered for IF, and only when collecting statistics
+    gba_pic_stats_entered(s, s->level);
+
+    return gba_io_get(s->io, offset);
+}
+
+static void gba_pic_write(void *opaque, hwaddr offset, uint16_t value,
+                          uint16_t mask)
 {
     gba_pic_state *s = (gba_pic_state *)opaque;
 
     switch (offset) {
-        case 0: // IE
-            CHECK_WIDTH_MAX(4);
-            s->irq_enabled = value & 0xffff;
-            if (size < 4) {
-                break;
+        case 0x200: // IE
+            value = gba_io_merge(s->io, offset, value, mask) & 0x3fff;
+            gba_io_set(s->io, offset, value);
+            s->irq_enabled = value;
+            break;
+
+        case 0x202: // IF
+            if (unlikely(s->stats_enabled)) {
+                uint32_t acked = s->level & value & mask;
+                int i;
+
+                gba_pic_stats_entered(s, acked);
+                for (i = 0; i < GBA_IRQ_SOURCES; i++) {
+                    if (acked & (1 << i)) {
+                        // Ends the measurement, with or without a sample
+                        s->stats[i].acks++;
+                        s->stats[i].pending_since = -1;
+                    }
+                }
             }
-            value >>= 16;
-            size -= 2;
 
-        case 2: // IF:
-            CHECK_WIDTH_MAX(2);
-            s->level &= ~value;
+            s->level &= ~(value & mask);
             break;
 
-        case 4: // WAITCNT
-            CHECK_WIDTH_MAX(4);
-            s->waitcnt = value & 0x7fff;
-            break;
-        case 8: // IME
-            CHECK_WIDTH_MAX(4);
-            s->master = !(value & 1);
+        case 0x204: // WAITCNT
+            gba_io_set(s->io, offset,
+                       gba_io_merge(s->io, offset, value, mask) & 0x7fff);
+            return;
+
+        case 0x208: // IME
+            value = gba_io_merge(s->io, offset, value, mask) & 1;
+            gba_io_set(s->io, offset, value);
+            s->master = value;
             break;
 
         default:
@@ -118,11 +446,34 @@ static void gba_pic_write(void *opaque, hwaddr offset, uint64_t value,
 }
 
 
-static const MemoryRegionOps gba_pic_ops = {
-    .read = gba_pic_read,
-    .write = gba_pic_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+static char *gba_pic_get_stats(Object *obj, Error **errp)
+{
+    gba_pic_state *s = FROM_SYSBUS(gba_pic_state, SYS_BUS_DEVICE(obj));
+    GString *str = g_string_new(NULL);
+    int i;
+
+    if (!s->stats_enabled) {
+        g_string_append(str, "disabled (set gba_pic.irq-stats=on)\n");
+        return g_string_free(str, false);
+    }
+
+    g_string_append(str, "source   raises     acks       avg latency  "
+                         "max latency (cycles)\n");
+
+    for (i = 0; i < GBA_IRQ_SOURCES; i++) {
+        const gba_irq_stats *st = &s->stats[i];
+
+        g_string_append_printf(str, "%-8s %-10" PRIu64 " %-10" PRIu64
+                               " %-12" PRIu64 " %" PRIu64 "\n",
+                               gba_irq_names[i], st->raises, st->acks,
+                               st->latency_samples
+                               ? st->latency_total / st->latency_samples : 0,
+                               st->latency_max);
+    }
+
+    return g_string_free(str, false);
+}
+
 
 static int gba_pic_init(SysBusDevice *dev)
 {
@@ -130,9 +481,17 @@ static int gba_pic_init(SysBusDevice *dev)
 
     qdev_init_gpio_in(&dev->qdev, gba_pic_set_irq, 16);
     sysbus_init_irq(dev, &s->parent_irq);
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_pic_ops, s, "gba-pic",
-                          0x00000100);
-    sysbus_init_mmio(dev, &s->iomem);
+    sysbus_init_irq(dev, &s->wake_irq);
+
+    // IE, IF, WAITCNT and IME can all be read back directly
+    gba_io_register(s->io, 0x200, 0x0c, NULL, gba_pic_write, s);
+
+    if (s->stats_enabled) {
+        gba_io_register(s->io, 0x202, 0x02, gba_pic_read, gba_pic_write, s);
+    }
+
+    object_property_add_str(OBJECT(s), "irq-stats-report", gba_pic_get_stats,
+                            NULL, NULL);
 
     return 0;
 }
@@ -140,37 +499,29 @@ static int gba_pic_init(SysBusDevice *dev)
 
 typedef struct gba_dma_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
+    void *io;
     qemu_irq irq[4];
 } gba_dma_state;
 
 
-static uint64_t gba_dma_read(void *opaque, hwaddr offset, unsigned size)
+static uint16_t gba_dma_read(void *opaque, hwaddr offset)
 {
     BAD_REG_OFS_R;
     return 0;
 }
 
-static void gba_dma_write(void *opaque, hwaddr offset, uint64_t value,
-                          unsigned size)
+static void gba_dma_write(void *opaque, hwaddr offset, uint16_t value,
+                          uint16_t mask)
 {
     BAD_REG_OFS_W;
 }
 
 
-static const MemoryRegionOps gba_dma_ops = {
-    .read = gba_dma_read,
-    .write = gba_dma_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
-
 static int gba_dma_init(SysBusDevice *dev)
 {
     gba_dma_state *s = FROM_SYSBUS(gba_dma_state, dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_dma_ops, s, "gba-dma",
-                          0x00000050);
-    sysbus_init_mmio(dev, &s->iomem);
+    gba_io_register(s->io, 0x0b0, 0x50, gba_dma_read, gba_dma_write, s);
 
     sysbus_init_irq(dev, &s->irq[0]);
     sysbus_init_irq(dev, &s->irq[1]);
@@ -181,43 +532,134 @@ static int gba_dma_init(SysBusDevice *dev)
 }
 
 
+typedef enum gba_power_mode {
+    GBA_RUNNING,
+    GBA_HALTED,
+    GBA_STOPPED,
+} gba_power_mode;
+
+// Only serial, keypad and game pak interrupts can end STOP mode
+#define GBA_STOP_WAKE_IRQS ((1 << 7) | (1 << 12) | (1 << 13))
+
 typedef struct gba_ctrl_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
+    void *io;
+    void *cpu;
+    uint32_t mode; // gba_power_mode
 } gba_ctrl_state;
 
 
-static uint64_t gba_ctrl_read(void *opaque, hwaddr offset, unsigned size)
+static bool gba_ctrl_irq_pending(gba_ctrl_state *s)
+{
+    uint16_t pending = gba_io_get(s->io, 0x200) & gba_io_get(s->io, 0x202);
+
+    if (s->mode == GBA_STOPPED) {
+        pending &= GBA_STOP_WAKE_IRQS;
+    }
+
+    return pending;
+}
+
+
+static void gba_ctrl_wake(void *opaque, int irq, int level)
+{
+    gba_ctrl_state *s = (gba_ctrl_state *)opaque;
+
+    if (!level || (s->mode == GBA_RUNNING) || !gba_ctrl_irq_pending(s)) {
+        return;
+    }
+
+    s->mode = GBA_RUNNING;
+
+    // The CPU may not actually take the IRQ (IME or CPSR.I), but it has to
+    // leave the halted state nonetheless
+    cpu_interrupt(CPU(s->cpu), CPU_INTERRUPT_EXITTB);
+}
+
+
+static void gba_ctrl_reset(DeviceState *dev)
+{
+    gba_ctrl_state *s = FROM_SYSBUS(gba_ctrl_state, SYS_BUS_DEVICE(dev));
+
+    s->mode = GBA_RUNNING;
+}
+
+
+static uint16_t gba_ctrl_read(void *opaque, hwaddr offset)
 {
     BAD_REG_OFS_R;
     return 0;
 }
 
-static void gba_ctrl_write(void *opaque, hwaddr offset, uint64_t value,
-                           unsigned size)
+static void gba_ctrl_write(void *opaque, hwaddr offset, uint16_t value,
+                           uint16_t mask)
 {
-    BAD_REG_OFS_W;
-}
+    gba_ctrl_state *s = (gba_ctrl_state *)opaque;
 
+    switch (offset) {
+        case 0x300: // POSTFLG, HALTCNT
+            if (mask & 0x00ff) {
+                gba_io_set(s->io, offset, value & 1);
+            }
+
+            if (mask & 0xff00) {
+                s->mode = (value & 0x8000) ? GBA_STOPPED : GBA_HALTED;
+
+                if (gba_ctrl_irq_pending(s)) {
+                    s->mode = GBA_RUNNING;
+                } else {
+                    cpu_interrupt(CPU(s->cpu), CPU_INTERRUPT_HALT);
+                }
+            }
+            break;
+
+        default:
+            BAD_REG_OFS_W;
+            break;
+    }
+}
 
-static const MemoryRegionOps gba_ctrl_ops = {
-    .read = gba_ctrl_read,
-    .write = gba_ctrl_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
 
 static int gba_ctrl_init(SysBusDevice *dev)
 {
     gba_ctrl_state *s = FROM_SYSBUS(gba_ctrl_state, dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_ctrl_ops, s, "gba-ctrl",
-                          0x00000d00);
-    sysbus_init_mmio(dev, &s->iomem);
+    qdev_init_gpio_in(&dev->qdev, gba_ctrl_wake, 1);
+
+    // HALTCNT is write-only, so reading POSTFLG/HALTCNT just yields POSTFLG
+    gba_io_register(s->io, 0x300, 0x100, gba_ctrl_read, gba_ctrl_write, s);
+    gba_io_register(s->io, 0x300, 0x002, NULL, gba_ctrl_write, s);
 
     return 0;
 }
 
 
+/*
+ * Like sysbus_create_varargs(), but hands the I/O register file to the device
+ * before initializing it, so it can register its handlers.
+ */
+static DeviceState *gba_create_io_device(const char *name, gba_io_state *io,
+                                         ...)
+{
+    DeviceState *dev = qdev_create(NULL, name);
+    qdev_prop_set_ptr(dev, "io", io);
+    qdev_init_nofail(dev);
+
+    va_list va;
+    va_start(va, io);
+
+    int n = 0;
+    qemu_irq irq;
+    while ((irq = va_arg(va, qemu_irq))) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(dev), n++, irq);
+    }
+
+    va_end(va);
+
+    return dev;
+}
+
+
 static void gba_map_mirrored(MemoryRegion *sys_as, MemoryRegion *mreg,
                              hwaddr start, hwaddr end, uint64_t size,
                              uint64_t skips)
@@ -249,6 +691,7 @@ static MemoryRegion *gba_create_ram(MemoryRegion *sys_as, const char *name,
 {
     MemoryRegion *mreg = g_new(MemoryRegion, 1);
     memory_region_init_ram(mreg, NULL, name, size);
+    vmstate_register_ram_global(mreg);
 
     gba_map_mirrored(sys_as, mreg, start, end, size, skips);
 
@@ -256,12 +699,42 @@ static MemoryRegion *gba_create_ram(MemoryRegion *sys_as, const char *name,
 }
 
 
+/*
+ * Machine-wide reset. This runs before the devices' reset handlers, which
+ * therefore can put their own registers into the cleared register file.
+ */
+typedef struct gba_reset_info {
+    ARMCPU *cpu;
+    gba_io_state *io;
+    MemoryRegion *ram[5];
+} gba_reset_info;
+
+static void gba_reset(void *opaque)
+{
+    gba_reset_info *info = (gba_reset_info *)opaque;
+    int i;
+
+    cpu_reset(CPU(info->cpu));
+
+    memset(info->io->regs, 0, sizeof(info->io->regs));
+    info->io->idle = false;
+    info->io->poll_count = 0;
+
+    for (i = 0; i < ARRAY_SIZE(info->ram); i++) {
+        memset(memory_region_get_ram_ptr(info->ram[i]), 0,
+               memory_region_size(info->ram[i]));
+    }
+}
+
+
 static void gba_init(QEMUMachineInitArgs *args)
 {
     const char *cpu_model = args->cpu_model;
 
+    // The GBA has an ARM7TDMI, i.e. an ARMv4T core without cp15, MMU or MPU
+    // (the model is added to target-arm by the build-system diff)
     if (!cpu_model) {
-        cpu_model = "arm946";
+        cpu_model = "arm7tdmi";
     }
 
     ARMCPU *cpu = cpu_arm_init(cpu_model);
@@ -279,51 +752,101 @@ static void gba_init(QEMUMachineInitArgs *args)
                                             0x00004000, 0x00004000);
     memory_region_set_readonly(bios_rom, true);
 
-    gba_create_ram(sys_as, "gba.ext_wram", 0x02000000, 0x03000000,
-                                           0x00040000, 0x00040000);
+    MemoryRegion *ext_wram = gba_create_ram(sys_as, "gba.ext_wram",
+                                            0x02000000, 0x03000000,
+                                            0x00040000, 0x00040000);
 
-    gba_create_ram(sys_as, "gba.int_wram", 0x03000000, 0x04000000,
-                                           0x00008000, 0x00008000);
+    MemoryRegion *int_wram = gba_create_ram(sys_as, "gba.int_wram",
+                                            0x03000000, 0x04000000,
+                                            0x00008000, 0x00008000);
 
-    gba_create_ram(sys_as, "gba.bg/obj_palette_ram", 0x05000000, 0x06000000,
-                                                     0x00000400, 0x00000400);
+    MemoryRegion *palette = gba_create_ram(sys_as, "gba.bg/obj_palette_ram",
+                                           0x05000000, 0x06000000,
+                                           0x00000400, 0x00000400);
 
-    gba_create_ram(sys_as, "gba.vram", 0x06000000, 0x07000000,
-                                       0x00018000, 0x00020000);
+    MemoryRegion *vram = gba_create_ram(sys_as, "gba.vram",
+                                        0x06000000, 0x07000000,
+                                        0x00018000, 0x00020000);
 
-    gba_create_ram(sys_as, "gba.oam", 0x07000000, 0x08000000,
-                                      0x00000400, 0x00000400);
+    MemoryRegion *oam = gba_create_ram(sys_as, "gba.oam",
+                                       0x07000000, 0x08000000,
+                                       0x00000400, 0x00000400);
 
     MemoryRegion *cart = gba_create_ram(sys_as, "gba.cart",
                                         0x08000000, 0x0e000000,
                                         0x02000000, 0x02000000);
     memory_region_set_readonly(cart, true);
 
-    gba_create_ram(sys_as, "gba.sram", 0x0e000000, 0x10000000,
-                                       0x00010000, 0x00010000);
+    MemoryRegion *sram = gba_create_ram(sys_as, "gba.sram",
+                                        0x0e000000, 0x10000000,
+                                        0x00010000, 0x00010000);
 
 
+    DeviceState *io_dev = qdev_create(NULL, "gba_io");
+    qdev_prop_set_ptr(io_dev, "cpu", cpu);
+    qdev_init_nofail(io_dev);
+    sysbus_mmio_map(SYS_BUS_DEVICE(io_dev), 0, 0x04000000);
+
+    gba_io_state *io = FROM_SYSBUS(gba_io_state, SYS_BUS_DEVICE(io_dev));
+
     qemu_irq *cpu_pic = arm_pic_init_cpu(cpu);
     qemu_irq pic[16];
 
-    DeviceState *dev = sysbus_create_simple("gba_pic", 0x04000200,
-                                            cpu_pic[ARM_PIC_CPU_IRQ]);
+    DeviceState *pic_dev = gba_create_io_device("gba_pic", io,
+                                                cpu_pic[ARM_PIC_CPU_IRQ],
+                                                NULL);
 
     int i;
     for (i = 0; i < 16; i++) {
-        pic[i] = qdev_get_gpio_in(dev, i);
+        pic[i] = qdev_get_gpio_in(pic_dev, i);
+    }
+
+    gba_create_io_device("gba_sound",  io, NULL);
+    gba_create_io_device("gba_dma",    io, pic[8], pic[9], pic[10], pic[11],
+                                           NULL);
+    gba_create_io_device("gba_timer",  io, pic[3], pic[4], pic[5], pic[6],
+                                           NULL);
+    gba_create_io_device("gba_serial", io, pic[7], NULL);
+    DeviceState *input_dev = gba_create_io_device("gba_input", io, pic[12],
+                                                  NULL);
+
+    DeviceState *lcd_dev = qdev_create(NULL, "gba_lcd");
+    qdev_prop_set_ptr(lcd_dev, "io", io);
+    qdev_prop_set_ptr(lcd_dev, "palette", palette);
+    qdev_prop_set_ptr(lcd_dev, "vram", vram);
+    qdev_prop_set_ptr(lcd_dev, "oam", oam);
+    qdev_init_nofail(lcd_dev);
+
+    for (i = 0; i < 3; i++) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(lcd_dev), i, pic[i]);
     }
 
-    sysbus_create_varargs("gba_lcd",    0x04000000,
-                          pic[0], pic[1], pic[2], NULL);
-    sysbus_create_varargs("gba_sound",  0x04000060, NULL);
-    sysbus_create_varargs("gba_dma",    0x040000b0,
-                          pic[8], pic[9], pic[10], pic[11], NULL);
-    sysbus_create_varargs("gba_timer",  0x04000100,
-                          pic[3], pic[4], pic[5], pic[6], NULL);
-    sysbus_create_simple ("gba_serial", 0x04000120, pic[7]);
-    sysbus_create_simple ("gba_input",  0x04000130, pic[12]);
-    sysbus_create_varargs("gba_ctrl",   0x04000300, NULL);
+    DeviceState *ctrl_dev = qdev_create(NULL, "gba_ctrl");
+    qdev_prop_set_ptr(ctrl_dev, "io", io);
+    qdev_prop_set_ptr(ctrl_dev, "cpu", cpu);
+    qdev_init_nofail(ctrl_dev);
+
+    sysbus_connect_irq(SYS_BUS_DEVICE(pic_dev), 1,
+                       qdev_get_gpio_in(ctrl_dev, 0));
+
+    // Inert unless -global gba_batch.jobs=... is given
+    DeviceState *batch_dev = qdev_create(NULL, "gba_batch");
+    qdev_prop_set_ptr(batch_dev, "lcd", lcd_dev);
+    qdev_prop_set_ptr(batch_dev, "sram", sram);
+    qdev_init_nofail(batch_dev);
+
+    for (i = 0; i < 10; i++) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(batch_dev), i,
+                           qdev_get_gpio_in(input_dev, i));
+    }
+
+    gba_reset_info *reset_info = g_new(gba_reset_info, 1);
+    *reset_info = (gba_reset_info){
+        .cpu = cpu,
+        .io  = io,
+        .ram = { ext_wram, int_wram, palette, vram, oam },
+    };
+    qemu_register_reset(gba_reset, reset_info);
 
 
     if (load_image_targphys(bios_name, 0x00000000, 0x00004000) < 0) {
@@ -331,11 +854,34 @@ static void gba_init(QEMUMachineInitArgs *args)
         exit(1);
     }
 
-    if (load_image_targphys(args->kernel_filename, 0x08000000, 0x02000000) < 0)
-    {
-        fprintf(stderr, "Unable to load ROM file (use -kernel).\n");
-        exit(1);
+    // In batch mode, the batch runner loads each job's ROM on reset
+    char *batch_jobs = object_property_get_str(OBJECT(batch_dev), "jobs",
+                                               NULL);
+    bool batch = batch_jobs && *batch_jobs;
+    g_free(batch_jobs);
+
+    // The LCD only hashes frames if anyone listens
+    if (batch) {
+        sysbus_connect_irq(SYS_BUS_DEVICE(lcd_dev), 3,
+                           qdev_get_gpio_in(batch_dev, 0));
     }
+
+    int rom_size = 0;
+    if (!batch) {
+        rom_size = load_image_targphys(args->kernel_filename,
+                                       0x08000000, 0x02000000);
+        if (rom_size < 0) {
+            fprintf(stderr, "Unable to load ROM file (use -kernel).\n");
+            exit(1);
+        }
+    }
+
+    // Inert unless -global gba_tbcache.dir=... is given; needs the ROM loaded
+    DeviceState *tbcache_dev = qdev_create(NULL, "gba_tbcache");
+    qdev_prop_set_ptr(tbcache_dev, "cpu", cpu);
+    qdev_prop_set_ptr(tbcache_dev, "cart", cart);
+    qdev_prop_set_uint32(tbcache_dev, "rom-size", rom_size);
+    qdev_init_nofail(tbcache_dev);
 }
 
 
@@ -353,29 +899,124 @@ static void gba_machine_init(void)
 
 machine_init(gba_machine_init);
 
+static int gba_pic_post_load(void *opaque, int version_id)
+{
+    gba_pic_state *s = (gba_pic_state *)opaque;
+
+    // The output lines' targets have restored their own state
+    s->wake_pending = s->level & s->irq_enabled;
+    s->parent_level = s->master && s->wake_pending;
+
+    return 0;
+}
+
+
+/*
+ * Device state is kept small (registers live in the I/O register file, which
+ * is saved as a whole), so that saving and loading it stays cheap.
+ */
+
+static const VMStateDescription gba_io_vmstate = {
+    .name = "gba_io",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(regs, gba_io_state, GBA_IO_REGS),
+        VMSTATE_BOOL(idle, gba_io_state),
+        VMSTATE_UINT64(poll_offset, gba_io_state),
+        VMSTATE_UINT32(poll_size, gba_io_state),
+        VMSTATE_UINT32(poll_count, gba_io_state),
+        VMSTATE_UINT64(poll_value, gba_io_state),
+        VMSTATE_END_OF_LIST()
+    }
+}, gba_pic_vmstate = {
+    .name = "gba_pic",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = gba_pic_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(master, gba_pic_state),
+        VMSTATE_UINT32(level, gba_pic_state),
+        VMSTATE_UINT32(irq_enabled, gba_pic_state),
+        VMSTATE_UINT32(input, gba_pic_state),
+        VMSTATE_END_OF_LIST()
+    }
+}, gba_ctrl_vmstate = {
+    .name = "gba_ctrl",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mode, gba_ctrl_state),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+
+static Property gba_io_properties[] = {
+    DEFINE_PROP_PTR("cpu", gba_io_state, cpu),
+    DEFINE_PROP_BOOL("idle-detect", gba_io_state, idle_detect, false),
+    DEFINE_PROP_BOOL("fast-forward", gba_io_state, fast_forward, false),
+    DEFINE_PROP_END_OF_LIST(),
+}, gba_pic_properties[] = {
+    DEFINE_PROP_PTR("io", gba_pic_state, io),
+    DEFINE_PROP_BOOL("irq-stats", gba_pic_state, stats_enabled, false),
+    DEFINE_PROP_END_OF_LIST(),
+}, gba_dma_properties[] = {
+    DEFINE_PROP_PTR("io", gba_dma_state, io),
+    DEFINE_PROP_END_OF_LIST(),
+}, gba_ctrl_properties[] = {
+    DEFINE_PROP_PTR("io", gba_ctrl_state, io),
+    DEFINE_PROP_PTR("cpu", gba_ctrl_state, cpu),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void gba_io_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
+
+    sdc->init = gba_io_init;
+    dc->props = gba_io_properties;
+    dc->vmsd = &gba_io_vmstate;
+}
 
 static void gba_pic_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_pic_init;
+    dc->props = gba_pic_properties;
+    dc->vmsd = &gba_pic_vmstate;
+    dc->reset = gba_pic_reset;
 }
 
 static void gba_dma_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_dma_init;
+    dc->props = gba_dma_properties;
 }
 
 static void gba_ctrl_class_init(ObjectClass *klass, void *Data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_ctrl_init;
+    dc->props = gba_ctrl_properties;
+    dc->vmsd = &gba_ctrl_vmstate;
+    dc->reset = gba_ctrl_reset;
 }
 
-static const TypeInfo gba_pic_info = {
+static const TypeInfo gba_io_info = {
+    .name           = "gba_io",
+    .parent         = TYPE_SYS_BUS_DEVICE,
+    .instance_size  = sizeof(gba_io_state),
+    .class_init     = gba_io_class_init,
+}, gba_pic_info = {
     .name           = "gba_pic",
     .parent         = TYPE_SYS_BUS_DEVICE,
     .instance_size  = sizeof(gba_pic_state),
@@ -394,6 +1035,7 @@ static const TypeInfo gba_pic_info = {
 
 static void gba_register_types(void)
 {
+    type_register_static(&gba_io_info);
     type_register_static(&gba_pic_info);
     type_register_static(&gba_dma_info);
     type_register_static(&gba_ctrl_info);
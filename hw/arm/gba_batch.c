@@ -0,0 +1,349 @@
+#include "hw/hw.h"
+#include "hw/sysbus.h"
+#include "qemu/timer.h"
+#include "sysemu/cpus.h"
+#include "sysemu/sysemu.h"
+
+
+/*
+ * Batch runner: Runs a list of jobs back to back in a single process, which
+ * saves starting QEMU and setting up the machine for every single test ROM.
+ *
+ * The jobs file (-global gba_batch.jobs=<file>) contains one job per line:
+ *
+ *     <ROM file> <frame count> [<input movie>]
+ *
+ * Empty lines and lines starting with '#' are ignored. An input movie is a
+ * text file with one hexadecimal number per line, giving the keys pressed
+ * during the respective frame in KEYINPUT bit order (but active high); the
+ * last line stays in effect until the job ends.
+ *
+ * Every job starts with a system reset, which loads the job's ROM into the
+ * (already existing) cartridge memory. Jobs are paced by guest frames, not by
+ * time: Once the given number of frames has been displayed, the hash of the
+ * last frame, a hash over the hashes of all of the job's frames and the wall
+ * time spent on the job are appended to the results file
+ * (-global gba_batch.results=<file>, defaults to stdout):
+ *
+ *     <ROM file> <frame count> <last frame hash> <all frames hash> <ms>
+ *
+ * QEMU exits after the last job.
+ *
+ * The hashes are only reproducible with a fixed -icount shift. Otherwise,
+ * vm_clock (which drives the LCD and the timers) follows the host clock, so
+ * the number of instructions the guest gets to execute per frame varies
+ * from run to run. A warning is printed if -icount is missing or set to auto.
+ * Even with a fixed shift, vm_clock normally keeps running in real time while
+ * the CPU is halted (e.g. in a VBlankIntrWait), which makes the point at
+ * which the guest wakes up depend on the host as well. The batch runner
+ * therefore makes halted CPUs skip straight to the next vm_clock event
+ * instead, like qtest does, which also keeps idle frames from taking up wall
+ * time.
+ */
+
+#define GBA_CART_BASE 0x08000000
+#define GBA_CART_SIZE 0x02000000
+
+typedef struct gba_batch_job {
+    char *rom;
+    uint64_t frames;
+    uint16_t *keys;
+    size_t key_count;
+} gba_batch_job;
+
+typedef struct gba_batch_state {
+    SysBusDevice busdev;
+    void *lcd;
+    void *sram;
+    qemu_irq keys[10];
+    char *jobs_file;
+    char *results_file;
+
+    gba_batch_job *jobs;
+    int job_count;
+    int current;
+    bool switching;
+
+    FILE *results;
+    uint64_t frame;
+    uint32_t frames_hash;
+    int64_t start_time;
+    size_t rom_size;
+} gba_batch_state;
+
+
+static uint16_t *gba_batch_load_movie(const char *filename, size_t *count)
+{
+    char *contents, **lines;
+    uint16_t *keys;
+    int i;
+
+    if (!g_file_get_contents(filename, &contents, NULL, NULL)) {
+        fprintf(stderr, "gba_batch: Unable to read movie %s\n", filename);
+        exit(1);
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    keys = g_new(uint16_t, g_strv_length(lines));
+    *count = 0;
+
+    for (i = 0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        if (*line) {
+            keys[(*count)++] = strtoul(line, NULL, 16) & 0x03ff;
+        }
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+
+    return keys;
+}
+
+static void gba_batch_load_jobs(gba_batch_state *s)
+{
+    char *contents, **lines;
+    int i;
+
+    if (!g_file_get_contents(s->jobs_file, &contents, NULL, NULL)) {
+        fprintf(stderr, "gba_batch: Unable to read job list %s\n",
+                s->jobs_file);
+        exit(1);
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    s->jobs = g_new0(gba_batch_job, g_strv_length(lines));
+
+    for (i = 0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        char **fields;
+
+        if (!*line || (*line == '#')) {
+            continue;
+        }
+
+        fields = g_strsplit_set(line, " \t", -1);
+
+        gba_batch_job *job = &s->jobs[s->job_count];
+        int field_count = 0, j;
+
+        for (j = 0; fields[j]; j++) {
+            if (!*fields[j]) {
+                continue;
+            }
+
+            switch (field_count++) {
+                case 0:
+                    job->rom = g_strdup(fields[j]);
+                    break;
+                case 1:
+                    job->frames = strtoull(fields[j], NULL, 0);
+                    break;
+                case 2:
+                    job->keys = gba_batch_load_movie(fields[j],
+                                                     &job->key_count);
+                    break;
+            }
+        }
+
+        g_strfreev(fields);
+
+        if ((field_count < 2) || (field_count > 3) || !job->frames) {
+            fprintf(stderr, "gba_batch: Invalid job in line %i: %s\n", i + 1,
+                    line);
+            exit(1);
+        }
+
+        s->job_count++;
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+
+    if (!s->job_count) {
+        fprintf(stderr, "gba_batch: No jobs given\n");
+        exit(1);
+    }
+}
+
+
+static void gba_batch_set_keys(gba_batch_state *s)
+{
+    const gba_batch_job *job = &s->jobs[s->current];
+    uint16_t keys = 0;
+    int i;
+
+    if (job->key_count) {
+        keys = job->keys[MIN(s->frame, job->key_count - 1)];
+    }
+
+    for (i = 0; i < ARRAY_SIZE(s->keys); i++) {
+        qemu_set_irq(s->keys[i], (keys >> i) & 1);
+    }
+}
+
+/*
+ * Loads the current job's ROM. Writing through cpu_physical_memory_write_rom()
+ * invalidates any code translated from the previous ROM.
+ */
+static void gba_batch_load_rom(gba_batch_state *s)
+{
+    const gba_batch_job *job = &s->jobs[s->current];
+    gchar *rom;
+    gsize size;
+
+    if (!g_file_get_contents(job->rom, &rom, &size, NULL) ||
+        (size > GBA_CART_SIZE))
+    {
+        fprintf(stderr, "gba_batch: Unable to load ROM %s\n", job->rom);
+        exit(1);
+    }
+
+    cpu_physical_memory_write_rom(GBA_CART_BASE, (uint8_t *)rom, size);
+
+    // Clear whatever the previous ROM left behind
+    if (s->rom_size > size) {
+        uint8_t *zero = g_malloc0(s->rom_size - size);
+        cpu_physical_memory_write_rom(GBA_CART_BASE + size, zero,
+                                      s->rom_size - size);
+        g_free(zero);
+    }
+
+    s->rom_size = size;
+    g_free(rom);
+}
+
+
+static void gba_batch_frame(void *opaque, int irq, int level)
+{
+    gba_batch_state *s = (gba_batch_state *)opaque;
+
+    if (!level || !s->job_count || s->switching) {
+        return;
+    }
+
+    const gba_batch_job *job = &s->jobs[s->current];
+    uint32_t hash = object_property_get_int(OBJECT(s->lcd), "frame-hash",
+                                            NULL);
+    int i;
+
+    // FNV-1a over the frame hashes' bytes
+    for (i = 0; i < 32; i += 8) {
+        s->frames_hash = (s->frames_hash ^ ((hash >> i) & 0xff)) * 16777619;
+    }
+
+    if (++s->frame < job->frames) {
+        gba_batch_set_keys(s);
+        return;
+    }
+
+    int64_t duration = qemu_get_clock_ns(rt_clock) - s->start_time;
+
+    fprintf(s->results, "%s %" PRIu64 " %08" PRIx32 " %08" PRIx32
+            " %" PRIi64 "\n", job->rom, job->frames, hash, s->frames_hash,
+            duration / 1000000);
+    fflush(s->results);
+
+    if (++s->current >= s->job_count) {
+        qemu_system_shutdown_request();
+    } else {
+        qemu_system_reset_request();
+    }
+
+    // Frames still coming in until the reset happens do not count
+    s->switching = true;
+}
+
+
+static void gba_batch_reset(DeviceState *dev)
+{
+    gba_batch_state *s = FROM_SYSBUS(gba_batch_state, SYS_BUS_DEVICE(dev));
+
+    if (!s->job_count || (s->current >= s->job_count)) {
+        return;
+    }
+
+    gba_batch_load_rom(s);
+
+    // Save games must not carry over to the next job
+    memset(memory_region_get_ram_ptr(s->sram), 0,
+           memory_region_size(s->sram));
+
+    s->frame = 0;
+    s->frames_hash = 2166136261u;
+    s->switching = false;
+    gba_batch_set_keys(s);
+
+    s->start_time = qemu_get_clock_ns(rt_clock);
+}
+
+
+static int gba_batch_init(SysBusDevice *dev)
+{
+    gba_batch_state *s = FROM_SYSBUS(gba_batch_state, dev);
+    int i;
+
+    qdev_init_gpio_in(&dev->qdev, gba_batch_frame, 1);
+    for (i = 0; i < ARRAY_SIZE(s->keys); i++) {
+        sysbus_init_irq(dev, &s->keys[i]);
+    }
+
+    if (!s->jobs_file) {
+        return 0;
+    }
+
+    gba_batch_load_jobs(s);
+
+    // use_icount is 1 for a fixed shift and 2 for -icount auto
+    if (use_icount != 1) {
+        fprintf(stderr, "gba_batch: Warning: Frame hashes are only "
+                "reproducible with a fixed -icount shift\n");
+    }
+    icount_sleep = false;
+
+    if (s->results_file) {
+        s->results = fopen(s->results_file, "w");
+        if (!s->results) {
+            fprintf(stderr, "gba_batch: Unable to open %s: %s\n",
+                    s->results_file, strerror(errno));
+            exit(1);
+        }
+    } else {
+        s->results = stdout;
+    }
+
+    return 0;
+}
+
+
+static Property gba_batch_properties[] = {
+    DEFINE_PROP_PTR("lcd", gba_batch_state, lcd),
+    DEFINE_PROP_PTR("sram", gba_batch_state, sram),
+    DEFINE_PROP_STRING("jobs", gba_batch_state, jobs_file),
+    DEFINE_PROP_STRING("results", gba_batch_state, results_file),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void gba_batch_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
+
+    sdc->init = gba_batch_init;
+    dc->props = gba_batch_properties;
+    dc->reset = gba_batch_reset;
+}
+
+static const TypeInfo gba_batch_info = {
+    .name          = "gba_batch",
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(gba_batch_state),
+    .class_init    = gba_batch_class_init,
+};
+
+static void gba_batch_register_types(void)
+{
+    type_register_static(&gba_batch_info);
+}
+
+type_init(gba_batch_register_types);
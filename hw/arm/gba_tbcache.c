@@ -0,0 +1,183 @@
+#include "hw/hw.h"
+#include "hw/sysbus.h"
+#include "hw/arm/arm.h"
+#include "exec/exec-all.h"
+#include "sysemu/sysemu.h"
+#include "tcg/tcg.h"
+
+
+/*
+ * Translation cache pre-warming: The cartridge is read-only, so code
+ * translated from it never gets invalidated, and a game translates the same
+ * hot blocks on every boot. With -global gba_tbcache.dir=<directory>, the
+ * (pc, cs_base, flags) triple of every hot translation block that came from
+ * the cartridge is written to <directory>/<ROM SHA-1>.tbs when QEMU exits. On
+ * the next boot of the same ROM, those blocks are translated before the guest
+ * starts running, so it does not have to stop for the translator in its hot
+ * paths.
+ *
+ * A block counts as hot once the main execution loop has looked it up at
+ * least gba_tbcache.min-execs times (8 by default). Jumps between chained
+ * blocks bypass that loop, so the count is a lower bound on how often a block
+ * ran; blocks inside tight loops still get looked up whenever the CPU leaves
+ * them for an interrupt or an I/O access. Blocks run only once or twice, like
+ * most of the boot code, are left out.
+ *
+ * Only the block list is stored, not the generated host code: that contains
+ * absolute host addresses (of the CPU state, helpers and other blocks) which
+ * differ from one process to the next.
+ *
+ * The file has one block per line, as three hexadecimal numbers:
+ *
+ *     <pc> <cs_base> <flags>
+ *
+ * In batch mode, the ROM changes with every job, so there is no cache.
+ */
+
+#define GBA_CART_BASE 0x08000000
+#define GBA_CART_END  0x0e000000 // including mirrors
+
+typedef struct gba_tbcache_state {
+    SysBusDevice busdev;
+    void *cpu;
+    void *cart;
+    uint32_t rom_size;
+    char *dir;
+    uint32_t min_execs;
+
+    char *file;
+    bool warmed;
+    Notifier exit_notifier;
+} gba_tbcache_state;
+
+
+static bool gba_tbcache_in_cart(target_ulong pc)
+{
+    return (pc >= GBA_CART_BASE) && (pc < GBA_CART_END);
+}
+
+
+static void gba_tbcache_warm(gba_tbcache_state *s)
+{
+    CPUARMState *env = &((ARMCPU *)s->cpu)->env;
+    char *contents, **lines;
+    int i;
+
+    if (!g_file_get_contents(s->file, &contents, NULL, NULL)) {
+        // Nothing cached yet
+        return;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+
+    for (i = 0; lines[i]; i++) {
+        unsigned long pc, cs_base, flags;
+
+        if (sscanf(lines[i], "%lx %lx %lx", &pc, &cs_base, &flags) != 3) {
+            continue;
+        }
+        if (!gba_tbcache_in_cart(pc)) {
+            continue;
+        }
+
+        tb_gen_code(env, pc, cs_base, flags, 0);
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+static void gba_tbcache_vm_state_change(void *opaque, int running,
+                                        RunState state)
+{
+    gba_tbcache_state *s = (gba_tbcache_state *)opaque;
+
+    // The CPU is not executing yet, so translating here is safe
+    if (running && !s->warmed) {
+        s->warmed = true;
+        gba_tbcache_warm(s);
+    }
+}
+
+
+static void gba_tbcache_save(Notifier *notifier, void *data)
+{
+    gba_tbcache_state *s = container_of(notifier, gba_tbcache_state,
+                                        exit_notifier);
+    GString *list = g_string_new(NULL);
+    int i;
+
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+        const TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+
+        if (gba_tbcache_in_cart(tb->pc) && (tb->exec_count >= s->min_execs)) {
+            g_string_append_printf(list, "%lx %lx %lx\n",
+                                   (unsigned long)tb->pc,
+                                   (unsigned long)tb->cs_base,
+                                   (unsigned long)tb->flags);
+        }
+    }
+
+    // Written to a temporary file and renamed, so the cache is never torn
+    if (!g_file_set_contents(s->file, list->str, list->len, NULL)) {
+        fprintf(stderr, "gba_tbcache: Unable to write %s\n", s->file);
+    }
+
+    g_string_free(list, true);
+}
+
+
+static int gba_tbcache_init(SysBusDevice *dev)
+{
+    gba_tbcache_state *s = FROM_SYSBUS(gba_tbcache_state, dev);
+
+    if (!s->dir || !s->rom_size) {
+        return 0;
+    }
+
+    const uint8_t *rom = memory_region_get_ram_ptr(s->cart);
+    gchar *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1, rom,
+                                              s->rom_size);
+    s->file = g_strdup_printf("%s/%s.tbs", s->dir, hash);
+    g_free(hash);
+
+    s->exit_notifier.notify = gba_tbcache_save;
+    qemu_add_exit_notifier(&s->exit_notifier);
+
+    qemu_add_vm_change_state_handler(gba_tbcache_vm_state_change, s);
+
+    return 0;
+}
+
+
+static Property gba_tbcache_properties[] = {
+    DEFINE_PROP_PTR("cpu", gba_tbcache_state, cpu),
+    DEFINE_PROP_PTR("cart", gba_tbcache_state, cart),
+    DEFINE_PROP_UINT32("rom-size", gba_tbcache_state, rom_size, 0),
+    DEFINE_PROP_STRING("dir", gba_tbcache_state, dir),
+    DEFINE_PROP_UINT32("min-execs", gba_tbcache_state, min_execs, 8),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void gba_tbcache_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
+
+    sdc->init = gba_tbcache_init;
+    dc->props = gba_tbcache_properties;
+}
+
+static const TypeInfo gba_tbcache_info = {
+    .name          = "gba_tbcache",
+    .parent        = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(gba_tbcache_state),
+    .class_init    = gba_tbcache_class_init,
+};
+
+static void gba_tbcache_register_types(void)
+{
+    type_register_static(&gba_tbcache_info);
+}
+
+type_init(gba_tbcache_register_types);
@@ -1,64 +1,36 @@
 #include "hw/sysbus.h"
+#include "hw/arm/gba.h"
 
 
 typedef struct gba_sound_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
-    uint8_t io_state[0x50];
+    void *io;
 } gba_sound_state;
 
 
-static uint64_t gba_sound_read(void *opaque, hwaddr offset, unsigned size)
-{
-    gba_sound_state *s = (gba_sound_state *)opaque;
-
-    uint64_t val = 0;
-
-    unsigned i;
-    for (i = 0; i < size; i++) {
-        val |= (uint64_t)s->io_state[offset++] << (i * 8);
-    }
-
-    return val;
-}
-
-
-static void gba_sound_write(void *opaque, hwaddr offset, uint64_t value,
-                            unsigned size)
-{
-    gba_sound_state *s = (gba_sound_state *)opaque;
-
-    unsigned i;
-    for (i = 0; i < size; i++) {
-        s->io_state[offset++] = value & 0xff;
-        value >>= 8;
-    }
-}
-
-
-static const MemoryRegionOps gba_sound_ops = {
-    .read = gba_sound_read,
-    .write = gba_sound_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
-
 static int gba_sound_init(SysBusDevice *dev)
 {
     gba_sound_state *s = FROM_SYSBUS(gba_sound_state, dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_sound_ops, s, "gba-sound",
-                          0x00000050);
-    sysbus_init_mmio(dev, &s->iomem);
+    // No side effects yet, so everything just lives in the I/O register file
+    gba_io_register(s->io, 0x60, 0x50, NULL, NULL, s);
 
     return 0;
 }
 
 
+static Property gba_sound_properties[] = {
+    DEFINE_PROP_PTR("io", gba_sound_state, io),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void gba_sound_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_sound_init;
+    dc->props = gba_sound_properties;
 }
 
 static const TypeInfo gba_sound_info = {
@@ -1,53 +1,674 @@
+#include "hw/hw.h"
 #include "hw/sysbus.h"
+#include "hw/arm/gba.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "sysemu/char.h"
+
+
+/*
+ * Link cable emulation: Two GBAs are connected through a chardev (e.g. a Unix
+ * socket or a pipe). Instead of shifting bits or bytes back and forth, both
+ * ends exchange complete transfers as fixed-size messages, each stamped with
+ * the sender's emulated time (in CPU cycles). Messages are queued and flushed
+ * from a bottom half, so everything the guest does in one go ends up in a
+ * single chardev write.
+ *
+ * Lockstep is kept only as tight as the mode requires:
+ *  - Normal mode: The slave announces its data when it gets ready for a
+ *    transfer, so the master can complete its transfer on its own, without
+ *    waiting for the other side. If the slave has not announced anything
+ *    since the last transfer, the master reads 0xffffffff, as if nothing
+ *    were connected.
+ *  - Multiplayer mode: The parent needs the child's data, so it waits for the
+ *    reply if it has not arrived when the transfer would be done. If there
+ *    is still no reply after GBA_LINK_MULTI_TIMEOUT, the child is considered
+ *    absent (no peer, or one that is not in multiplayer mode) and reads as
+ *    0xffff, as on hardware. Every transfer has a sequence number, which the
+ *    child echoes in its reply, so a late reply to a transfer that has timed
+ *    out is never taken for the answer to the next one.
+ *  - UART mode: Bytes are just forwarded; there is nothing to wait for.
+ */
+
+enum {
+    GBA_LINK_DATA,          // Slave is ready for a normal mode transfer
+    GBA_LINK_XFER,          // Master starts a normal mode transfer
+    GBA_LINK_MULTI_START,   // Parent starts a multiplayer transfer
+    GBA_LINK_MULTI_REPLY,   // Child's answer to GBA_LINK_MULTI_START
+    GBA_LINK_UART,          // UART byte
+};
+
+typedef struct QEMU_PACKED gba_link_msg {
+    uint8_t type;
+    uint8_t pad;
+    uint16_t seq; // Multiplayer transfer number (MULTI_START/MULTI_REPLY)
+    uint32_t data;
+    uint64_t timestamp;
+} gba_link_msg;
+
+#define GBA_LINK_TX_QUEUE 32
+// In cycles; about one frame
+#define GBA_LINK_MULTI_TIMEOUT (GBA_CPU_FREQ / 60)
+#define GBA_UART_FIFO_SIZE 4
+
+
+typedef enum gba_sio_mode {
+    GBA_SIO_NORMAL8,
+    GBA_SIO_NORMAL32,
+    GBA_SIO_MULTI,
+    GBA_SIO_UART,
+    GBA_SIO_GENERAL, // GPIO and JOY bus, neither of which is emulated
+} gba_sio_mode;
+
+typedef enum gba_sio_xfer {
+    GBA_XFER_NONE,
+    GBA_XFER_NORMAL,
+    GBA_XFER_MULTI,
+    GBA_XFER_UART_TX,
+} gba_sio_xfer;
 
 
 typedef struct gba_serial_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
+    void *io;
+    CharDriverState *chr;
+    uint32_t player;
     qemu_irq irq;
+
+    QEMUTimer *timer;
+    QEMUBH *flush_bh;
+
+    gba_link_msg tx_queue[GBA_LINK_TX_QUEUE];
+    unsigned tx_count;
+    uint8_t rx_buf[sizeof(gba_link_msg)];
+    unsigned rx_len;
+
+    // Minimum observed difference between our clock and the peer's
+    int64_t peer_offset;
+    bool peer_offset_valid;
+
+    uint32_t xfer; // gba_sio_xfer
+    uint32_t xfer_in;
+    bool xfer_done;
+
+    // Data the slave will shift out on the next normal mode transfer, if it
+    // has announced any since the last one
+    uint32_t peer_data;
+    bool peer_data_valid;
+    // Normal mode transfer started by the master before we were ready
+    bool xfer_pending;
+    int64_t xfer_pending_start;
+    uint32_t xfer_pending_data;
+
+    uint16_t multi_seq;
+    bool multi_reply_valid;
+    uint16_t multi_reply;
+
+    uint8_t uart_rx[GBA_UART_FIFO_SIZE];
+    unsigned uart_rx_count;
 } gba_serial_state;
 
 
-static uint64_t gba_serial_read(void *opaque, hwaddr offset, unsigned size)
+static int64_t gba_serial_now(void)
 {
-    printf("gba_serial_read: Bad register offset 0x%x\n", (int)offset);
-    return 0;
+    return muldiv64(qemu_get_clock_ns(vm_clock), GBA_CPU_FREQ,
+                    get_ticks_per_sec());
+}
+
+static int64_t gba_serial_cycles_to_ns(int64_t cycles)
+{
+    return muldiv64(cycles, get_ticks_per_sec(), GBA_CPU_FREQ);
+}
+
+
+static gba_sio_mode gba_serial_mode(gba_serial_state *s)
+{
+    if (gba_io_get(s->io, 0x134) & 0x8000) { // RCNT
+        return GBA_SIO_GENERAL;
+    }
+
+    return (gba_io_get(s->io, 0x128) >> 12) & 3; // SIOCNT
+}
+
+static int64_t gba_serial_duration(gba_serial_state *s, gba_sio_mode mode)
+{
+    static const int bauds[4] = { 9600, 38400, 57600, 115200 };
+    uint16_t siocnt = gba_io_get(s->io, 0x128);
+
+    switch (mode) {
+        case GBA_SIO_NORMAL8:
+        case GBA_SIO_NORMAL32:
+            // 256 kHz or 2 MHz shift clock
+            return ((mode == GBA_SIO_NORMAL8) ? 8 : 32)
+                 * ((siocnt & 2) ? 8 : 64);
+        case GBA_SIO_MULTI:
+            // Start bit, 16 data bits, stop bit; for parent and child
+            return 2 * 18 * GBA_CPU_FREQ / bauds[siocnt & 3];
+        case GBA_SIO_UART:
+            // Start bit, 8 data bits, stop bit
+            return 10 * GBA_CPU_FREQ / bauds[siocnt & 3];
+        default:
+            return 0;
+    }
+}
+
+
+static void gba_serial_flush(void *opaque)
+{
+    gba_serial_state *s = (gba_serial_state *)opaque;
+
+    if (s->chr && s->tx_count) {
+        qemu_chr_fe_write_all(s->chr, (const uint8_t *)s->tx_queue,
+                              s->tx_count * sizeof(gba_link_msg));
+    }
+
+    s->tx_count = 0;
+}
+
+static void gba_serial_send(gba_serial_state *s, int type, uint32_t data,
+                            uint16_t seq)
+{
+    if (!s->chr) {
+        return;
+    }
+
+    if (s->tx_count == GBA_LINK_TX_QUEUE) {
+        gba_serial_flush(s);
+    }
+
+    s->tx_queue[s->tx_count++] = (gba_link_msg){
+        .type      = type,
+        .seq       = cpu_to_le16(seq),
+        .data      = cpu_to_le32(data),
+        .timestamp = cpu_to_le64(gba_serial_now()),
+    };
+
+    qemu_bh_schedule(s->flush_bh);
+}
+
+
+/* Schedules the end of the current transfer for the given time (in cycles) */
+static void gba_serial_schedule(gba_serial_state *s, int64_t end)
+{
+    int64_t now = gba_serial_now();
+
+    if (end < now) {
+        end = now;
+    }
+
+    qemu_mod_timer_ns(s->timer, qemu_get_clock_ns(vm_clock) +
+                                gba_serial_cycles_to_ns(end - now));
+}
+
+/* The PIC latches IRQs on rising edges, so every event gets its own pulse */
+static void gba_serial_raise_irq(gba_serial_state *s)
+{
+    if (gba_io_get(s->io, 0x128) & (1 << 14)) {
+        qemu_irq_pulse(s->irq);
+    }
+}
+
+static void gba_serial_set_siocnt(gba_serial_state *s, uint16_t set,
+                                  uint16_t clear)
+{
+    gba_io_set(s->io, 0x128, (gba_io_get(s->io, 0x128) | set) & ~clear);
+}
+
+
+static void gba_serial_complete_normal(gba_serial_state *s)
+{
+    if (gba_serial_mode(s) == GBA_SIO_NORMAL32) {
+        gba_io_set(s->io, 0x120, s->xfer_in);
+        gba_io_set(s->io, 0x122, s->xfer_in >> 16);
+    } else {
+        gba_io_set(s->io, 0x12a, s->xfer_in & 0xff);
+    }
+
+    gba_serial_set_siocnt(s, 0, 1 << 7);
+    gba_serial_raise_irq(s);
+}
+
+static void gba_serial_complete_multi(gba_serial_state *s)
+{
+    if (!s->player) {
+        gba_io_set(s->io, 0x122, s->multi_reply_valid ? s->multi_reply
+                                                      : 0xffff);
+    }
+    gba_io_set(s->io, 0x124, 0xffff);
+    gba_io_set(s->io, 0x126, 0xffff);
+
+    s->multi_reply_valid = false;
+
+    // Clear busy and error, set our ID
+    gba_serial_set_siocnt(s, (s->player & 3) << 4, (3 << 4) | (3 << 6));
+    gba_serial_raise_irq(s);
+}
+
+
+static void gba_serial_timer(void *opaque)
+{
+    gba_serial_state *s = (gba_serial_state *)opaque;
+
+    switch (s->xfer) {
+        case GBA_XFER_NORMAL:
+            gba_serial_complete_normal(s);
+            break;
+
+        case GBA_XFER_MULTI:
+            // The parent has to wait for the child's data (once)
+            if (!s->player && s->chr && !s->multi_reply_valid &&
+                !s->xfer_done)
+            {
+                s->xfer_done = true;
+                gba_serial_schedule(s, gba_serial_now() +
+                                       GBA_LINK_MULTI_TIMEOUT);
+                return;
+            }
+            gba_serial_complete_multi(s);
+            break;
+
+        case GBA_XFER_UART_TX:
+            gba_serial_raise_irq(s);
+            break;
+
+        case GBA_XFER_NONE:
+            return;
+    }
+
+    s->xfer = GBA_XFER_NONE;
+}
+
+
+static uint32_t gba_serial_normal_data(gba_serial_state *s)
+{
+    if (gba_serial_mode(s) == GBA_SIO_NORMAL32) {
+        return gba_io_get(s->io, 0x120) | (gba_io_get(s->io, 0x122) << 16);
+    } else {
+        return gba_io_get(s->io, 0x12a) & 0xff;
+    }
 }
 
-static void gba_serial_write(void *opaque, hwaddr offset, uint64_t value,
-                            unsigned size)
+static void gba_serial_start_normal(gba_serial_state *s, int64_t start,
+                                    uint32_t data)
 {
-    printf("gba_serial_write: Bad register offset 0x%x (tried to write 0x%0*"
-           PRIx64 ")\n", (int)offset, size * 2, value);
+    s->xfer = GBA_XFER_NORMAL;
+    s->xfer_in = data;
+    gba_serial_schedule(s, start + gba_serial_duration(s,
+                                                       gba_serial_mode(s)));
 }
 
+static void gba_serial_start(gba_serial_state *s)
+{
+    gba_sio_mode mode = gba_serial_mode(s);
+    uint16_t siocnt = gba_io_get(s->io, 0x128);
+
+    switch (mode) {
+        case GBA_SIO_NORMAL8:
+        case GBA_SIO_NORMAL32: {
+            uint32_t data = gba_serial_normal_data(s);
+
+            if (siocnt & 1) {
+                // Master: The slave has announced its data already (if there
+                // is one that is ready); it has to do so again for the next
+                // transfer
+                gba_serial_send(s, GBA_LINK_XFER, data, 0);
+                gba_serial_start_normal(s, gba_serial_now(),
+                                        s->peer_data_valid ? s->peer_data
+                                                           : 0xffffffff);
+                s->peer_data_valid = false;
+            } else {
+                gba_serial_send(s, GBA_LINK_DATA, data, 0);
+                if (s->xfer_pending) {
+                    s->xfer_pending = false;
+                    gba_serial_start_normal(s, s->xfer_pending_start,
+                                            s->xfer_pending_data);
+                }
+            }
+            break;
+        }
+
+        case GBA_SIO_MULTI:
+            // Only the parent can start a transfer
+            if (s->player) {
+                break;
+            }
+
+            gba_io_set(s->io, 0x120, gba_io_get(s->io, 0x12a));
+            gba_serial_send(s, GBA_LINK_MULTI_START, gba_io_get(s->io, 0x12a),
+                            ++s->multi_seq);
+
+            s->xfer = GBA_XFER_MULTI;
+            s->xfer_done = false;
+            gba_serial_schedule(s, gba_serial_now() +
+                                   gba_serial_duration(s, mode));
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+static void gba_serial_receive_msg(gba_serial_state *s, const gba_link_msg *m)
+{
+    int64_t now = gba_serial_now();
+    int64_t ts = le64_to_cpu(m->timestamp);
+    uint32_t data = le32_to_cpu(m->data);
+    uint16_t seq = le16_to_cpu(m->seq);
+
+    if (!s->peer_offset_valid || (now - ts < s->peer_offset)) {
+        s->peer_offset = now - ts;
+        s->peer_offset_valid = true;
+    }
+
+    // Start of the transfer on the other side, in our time
+    int64_t start = ts + s->peer_offset;
+
+    gba_sio_mode mode = gba_serial_mode(s);
+    uint16_t siocnt = gba_io_get(s->io, 0x128);
+
+    switch (m->type) {
+        case GBA_LINK_DATA:
+            s->peer_data = data;
+            s->peer_data_valid = true;
+            break;
+
+        case GBA_LINK_XFER:
+            if ((mode != GBA_SIO_NORMAL8) && (mode != GBA_SIO_NORMAL32)) {
+                break;
+            }
+            if ((siocnt & (1 << 7)) && !(siocnt & 1)) {
+                gba_serial_start_normal(s, start, data);
+            } else {
+                // Not ready yet; the master may just be a bit ahead of us
+                s->xfer_pending = true;
+                s->xfer_pending_start = start;
+                s->xfer_pending_data = data;
+            }
+            break;
+
+        case GBA_LINK_MULTI_START:
+            if ((mode != GBA_SIO_MULTI) || !s->player) {
+                break;
+            }
+
+            gba_io_set(s->io, 0x120, data);
+            gba_io_set(s->io, 0x122, gba_io_get(s->io, 0x12a));
+            gba_serial_send(s, GBA_LINK_MULTI_REPLY, gba_io_get(s->io, 0x12a),
+                            seq);
+
+            gba_serial_set_siocnt(s, 1 << 7, 0);
+            s->xfer = GBA_XFER_MULTI;
+            gba_serial_schedule(s, start + gba_serial_duration(s, mode));
+            break;
+
+        case GBA_LINK_MULTI_REPLY:
+            // Too late if the transfer it answers has timed out already
+            if ((s->xfer != GBA_XFER_MULTI) || s->player ||
+                (seq != s->multi_seq))
+            {
+                break;
+            }
+
+            s->multi_reply = data;
+            s->multi_reply_valid = true;
+
+            if (s->xfer_done) {
+                qemu_del_timer(s->timer);
+                gba_serial_complete_multi(s);
+                s->xfer = GBA_XFER_NONE;
+            }
+            break;
+
+        case GBA_LINK_UART: {
+            if ((mode != GBA_SIO_UART) || !(siocnt & (1 << 11))) {
+                break;
+            }
+
+            unsigned fifo_size = (siocnt & (1 << 8)) ? GBA_UART_FIFO_SIZE : 1;
+            if (s->uart_rx_count >= fifo_size) {
+                gba_serial_set_siocnt(s, 1 << 6, 0); // Overrun
+            } else {
+                s->uart_rx[s->uart_rx_count++] = data;
+            }
+
+            gba_serial_raise_irq(s);
+            break;
+        }
+    }
+}
+
+
+static int gba_serial_can_receive(void *opaque)
+{
+    gba_serial_state *s = (gba_serial_state *)opaque;
+
+    return sizeof(s->rx_buf) - s->rx_len;
+}
+
+static void gba_serial_receive(void *opaque, const uint8_t *buf, int size)
+{
+    gba_serial_state *s = (gba_serial_state *)opaque;
+
+    while (size > 0) {
+        int len = MIN(size, (int)(sizeof(s->rx_buf) - s->rx_len));
+
+        memcpy(s->rx_buf + s->rx_len, buf, len);
+        s->rx_len += len;
+        buf += len;
+        size -= len;
+
+        if (s->rx_len == sizeof(s->rx_buf)) {
+            gba_link_msg m;
+            memcpy(&m, s->rx_buf, sizeof(m));
+            s->rx_len = 0;
+
+            gba_serial_receive_msg(s, &m);
+        }
+    }
+}
 
-static const MemoryRegionOps gba_serial_ops = {
-    .read = gba_serial_read,
-    .write = gba_serial_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
+static void gba_serial_event(void *opaque, int event)
+{
+    gba_serial_state *s = (gba_serial_state *)opaque;
+
+    if (event == CHR_EVENT_OPENED) {
+        s->rx_len = 0;
+        s->peer_offset_valid = false;
+        s->peer_data_valid = false;
+        s->xfer_pending = false;
+    }
+}
+
+
+static uint16_t gba_serial_read(void *opaque, hwaddr offset)
+{
+    gba_serial_state *s = (gba_serial_state *)opaque;
+    gba_sio_mode mode = gba_serial_mode(s);
+    uint16_t value = gba_io_get(s->io, offset);
+
+    switch (offset) {
+        case 0x128: // SIOCNT
+            if (mode == GBA_SIO_UART) {
+                value &= ~((1 << 4) | (1 << 5));
+                value |= (s->xfer == GBA_XFER_UART_TX) << 4; // Send full
+                value |= !s->uart_rx_count             << 5; // Receive empty
+            } else if (mode == GBA_SIO_MULTI) {
+                value &= ~((1 << 2) | (1 << 3));
+                value |= !!s->player << 2; // SI: 0 = parent, 1 = child
+                value |= !!s->chr    << 3; // SD: all ready
+            }
+            return value;
+
+        case 0x12a: // SIODATA8
+            if (mode != GBA_SIO_UART) {
+                return value;
+            }
+
+            // Pop from the receive FIFO
+            if (!s->uart_rx_count) {
+                return 0;
+            }
+
+            value = s->uart_rx[0];
+            memmove(s->uart_rx, s->uart_rx + 1, --s->uart_rx_count);
+            return value;
+
+        default:
+            return value;
+    }
+}
+
+static void gba_serial_write(void *opaque, hwaddr offset, uint16_t value,
+                             uint16_t mask)
+{
+    gba_serial_state *s = (gba_serial_state *)opaque;
+    uint16_t old;
+
+    switch (offset) {
+        case 0x128: // SIOCNT
+            old = gba_io_get(s->io, offset);
+
+            // SI, SD, ID and the UART flags cannot be written
+            switch (gba_serial_mode(s)) {
+                case GBA_SIO_UART:
+                    mask &= ~((1 << 4) | (1 << 5));
+                    break;
+                case GBA_SIO_MULTI:
+                    mask &= ~((1 << 2) | (1 << 3) | (3 << 4));
+                    break;
+                default:
+                    mask &= ~(1 << 2);
+                    break;
+            }
+            if (s->xfer != GBA_XFER_NONE) {
+                mask &= ~(1 << 7);
+            }
+            gba_io_set(s->io, offset, gba_io_merge(s->io, offset, value, mask));
+
+            if (!(old & (1 << 7)) && (value & mask & (1 << 7))) {
+                gba_serial_start(s);
+            }
+            break;
+
+        case 0x12a: // SIODATA8, SIOMLT_SEND
+            gba_io_set(s->io, offset, gba_io_merge(s->io, offset, value, mask));
+
+            if ((gba_serial_mode(s) == GBA_SIO_UART) && (mask & 0xff) &&
+                (gba_io_get(s->io, 0x128) & (1 << 10)))
+            {
+                gba_serial_send(s, GBA_LINK_UART, value & 0xff, 0);
+
+                s->xfer = GBA_XFER_UART_TX;
+                gba_serial_schedule(s, gba_serial_now() +
+                                       gba_serial_duration(s, GBA_SIO_UART));
+            }
+            break;
+
+        case 0x134: // RCNT
+            gba_io_set(s->io, offset, gba_io_merge(s->io, offset, value, mask));
+            break;
+    }
+}
+
+
+/*
+ * Messages already handed to the peer cannot be taken back, so anything
+ * queued is sent out before saving; the peer is not part of the snapshot.
+ */
+static void gba_serial_pre_save(void *opaque)
+{
+    gba_serial_flush(opaque);
+}
+
+static const VMStateDescription gba_serial_vmstate = {
+    .name = "gba_serial",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = gba_serial_pre_save,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER(timer, gba_serial_state),
+        VMSTATE_UINT8_ARRAY(rx_buf, gba_serial_state, sizeof(gba_link_msg)),
+        VMSTATE_UINT32(rx_len, gba_serial_state),
+        VMSTATE_INT64(peer_offset, gba_serial_state),
+        VMSTATE_BOOL(peer_offset_valid, gba_serial_state),
+        VMSTATE_UINT32(xfer, gba_serial_state),
+        VMSTATE_UINT32(xfer_in, gba_serial_state),
+        VMSTATE_BOOL(xfer_done, gba_serial_state),
+        VMSTATE_UINT32(peer_data, gba_serial_state),
+        VMSTATE_BOOL(peer_data_valid, gba_serial_state),
+        VMSTATE_BOOL(xfer_pending, gba_serial_state),
+        VMSTATE_INT64(xfer_pending_start, gba_serial_state),
+        VMSTATE_UINT32(xfer_pending_data, gba_serial_state),
+        VMSTATE_UINT16(multi_seq, gba_serial_state),
+        VMSTATE_BOOL(multi_reply_valid, gba_serial_state),
+        VMSTATE_UINT16(multi_reply, gba_serial_state),
+        VMSTATE_UINT8_ARRAY(uart_rx, gba_serial_state, GBA_UART_FIFO_SIZE),
+        VMSTATE_UINT32(uart_rx_count, gba_serial_state),
+        VMSTATE_END_OF_LIST()
+    }
 };
 
 
+static void gba_serial_reset(DeviceState *dev)
+{
+    gba_serial_state *s = FROM_SYSBUS(gba_serial_state, SYS_BUS_DEVICE(dev));
+
+    qemu_del_timer(s->timer);
+
+    s->tx_count = 0;
+    s->rx_len = 0;
+    s->peer_offset_valid = false;
+
+    s->xfer = GBA_XFER_NONE;
+    s->xfer_done = false;
+    s->peer_data_valid = false;
+    s->xfer_pending = false;
+    s->multi_reply_valid = false;
+    s->uart_rx_count = 0;
+}
+
+
 static int gba_serial_init(SysBusDevice *dev)
 {
     gba_serial_state *s = FROM_SYSBUS(gba_serial_state, dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_serial_ops, s, "gba-serial",
-                          0x00000004);
-    sysbus_init_mmio(dev, &s->iomem);
+    // SIODATA32/SIOMULTI0-3 are plain storage; JOY bus is not emulated
+    gba_io_register(s->io, 0x120, 0x0c, NULL, NULL, s);
+    gba_io_register(s->io, 0x128, 0x04, gba_serial_read, gba_serial_write, s);
+    gba_io_register(s->io, 0x134, 0x02, NULL, gba_serial_write, s);
+    gba_io_register(s->io, 0x140, 0x1c, NULL, NULL, s);
 
     sysbus_init_irq(dev, &s->irq);
 
+    s->timer = qemu_new_timer_ns(vm_clock, gba_serial_timer, s);
+    s->flush_bh = qemu_bh_new(gba_serial_flush, s);
+
+    if (s->chr) {
+        qemu_chr_add_handlers(s->chr, gba_serial_can_receive,
+                              gba_serial_receive, gba_serial_event, s);
+    }
+
     return 0;
 }
 
 
+static Property gba_serial_properties[] = {
+    DEFINE_PROP_PTR("io", gba_serial_state, io),
+    DEFINE_PROP_CHR("chardev", gba_serial_state, chr),
+    DEFINE_PROP_UINT32("player", gba_serial_state, player, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void gba_serial_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_serial_init;
+    dc->props = gba_serial_properties;
+    dc->vmsd = &gba_serial_vmstate;
+    dc->reset = gba_serial_reset;
 }
 
 static const TypeInfo gba_serial_info = {
@@ -1,59 +1,1574 @@
+#include "hw/hw.h"
 #include "hw/sysbus.h"
+#include "hw/arm/gba.h"
+#include "qapi/visitor.h"
 #include "ui/console.h"
 #include "ui/pixel_ops.h"
 #include "qemu/timer.h"
 
 
+#define GBA_LCD_WIDTH  240
+#define GBA_LCD_HEIGHT 160
+
+// Accesses an LCD register in a register file snapshot
+#define LCD_REG(regs, ofs) ((regs)[(ofs) >> 1])
+
+// Layer line buffers use bit 15 (unused in BGR555) to mark transparent pixels
+#define GBA_TRANSPARENT 0x8000
+
+enum {
+    GBA_LAYER_BG0,
+    GBA_LAYER_BG1,
+    GBA_LAYER_BG2,
+    GBA_LAYER_BG3,
+    GBA_LAYER_OBJ,
+    GBA_LAYER_BD,
+};
+
+// Per-pixel OBJ attributes (besides the priority in bits 0-1)
+#define GBA_OBJ_SEMI_TRANS (1 << 2)
+#define GBA_OBJ_WINDOW     (1 << 3)
+
+enum {
+    GBA_EFFECT_NONE,
+    GBA_EFFECT_ALPHA,
+    GBA_EFFECT_BRIGHTEN,
+    GBA_EFFECT_DARKEN,
+};
+
+/*
+ * Window control for a span of pixels: Bits 0-4 enable BG0-3 and OBJ, bit 5
+ * enables color effects (same layout as WININ/WINOUT).
+ */
+typedef struct gba_lcd_span {
+    int x0, x1;
+    uint8_t ctrl;
+} gba_lcd_span;
+
+typedef struct gba_lcd_line {
+    uint16_t bg[4][GBA_LCD_WIDTH];
+    uint16_t obj[GBA_LCD_WIDTH];
+    uint8_t obj_attr[GBA_LCD_WIDTH];
+    bool obj_semi_trans, obj_window;
+
+    gba_lcd_span spans[GBA_LCD_WIDTH];
+
+    // Top and second layer colors and the effect to apply (for blending)
+    uint16_t top[GBA_LCD_WIDTH], bot[GBA_LCD_WIDTH];
+    uint8_t op[GBA_LCD_WIDTH];
+} gba_lcd_line;
+
+
+/*
+ * Tile cache: BG and OBJ tiles are decoded to one byte per pixel (palette
+ * index), both as they are and flipped horizontally. The cache has one slot
+ * per 32 byte VRAM unit and color depth, so tiles never evict each other.
+ * VRAM dirty tracking bumps the generation of each modified VRAM block;
+ * entries from a block whose generation has changed are compared against VRAM
+ * again and only decoded anew if their tile has actually been modified.
+ */
+
+#define GBA_VRAM_SIZE        0x18000
+#define GBA_VRAM_BLOCK_SIZE  0x400
+#define GBA_VRAM_BLOCKS      (GBA_VRAM_SIZE / GBA_VRAM_BLOCK_SIZE)
+
+// VRAM blocks covered by the mode 3 frame buffer
+
+#define GBA_TILE_CACHE_SLOTS ((GBA_VRAM_SIZE / 32) * 2)
+
+#define GBA_TILE_VALID (1u << 31)
+#define GBA_TILE_8BPP  (1u << 30)
+
+typedef struct gba_tile_entry {
+    uint32_t tag;
+    uint32_t gen;
+    uint8_t raw[64];
+    uint8_t pix[2][64]; // [hflip][y * 8 + x]
+} gba_tile_entry;
+
+
+/*
+ * Deferred rendering: Instead of rendering every line when it starts, all
+ * writes to the LCD registers during the frame are logged together with the
+ * line they happened on, and the whole frame is rendered in one batch at the
+ * start of VBlank by replaying that log. VRAM, OAM and palette writes cannot
+ * be replayed; instead, memory is copied at the start of the frame. Once the
+ * memory is found to have changed, the lines pending so far are rendered from
+ * that copy and the rest of the frame is rendered line by line. Every line
+ * records the memory "epoch" it started in; if the memory changed mid-frame,
+ * the following frames are rendered line by line right away until the guest
+ * has stopped doing so for a while.
+ *
+ * Batches use the same per-line pipeline, except that text BG tiles are
+ * converted through a BG palette decoded once per batch. Only plain mode 3
+ * frames skip the pipeline entirely.
+ */
+
+#define GBA_LCD_LOG_SIZE 1024
+#define GBA_PALETTE_SIZE 0x400
+#define GBA_OAM_SIZE     0x400
+#define GBA_LCD_DEFER_HOLDOFF 60
+
+typedef struct gba_lcd_reg_write {
+    uint8_t line;
+    uint8_t offset;
+    uint16_t value;
+} gba_lcd_reg_write;
+
+
 typedef struct gba_lcd_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
+    void *io;
+    void *palette_mr, *vram_mr, *oam_mr;
+    const uint8_t *palette, *vram, *oam;
     QemuConsole *con;
     QEMUTimer *timer;
+    uint64_t next_call;
     bool invalidate;
     bool hblank;
     int ly, lyc;
     bool irq_vb_en, irq_hb_en, irq_vm_en;
-    int bg_mode;
-    int bgm_45_frame;
-    bool hb_intvl_free;
-    bool obj_vram_map_2d;
-    bool forced_blank;
-    bool display_bg[4], display_obj, display_wnd[2], display_ownd;
+    bool irq_vb_level, irq_hb_level, irq_vm_level;
     qemu_irq irq_vb, irq_hb, irq_vm;
+
+    // FNV-1a hash over the BGR555 output of the current/last frame; the frame
+    // IRQ is pulsed whenever a frame (and its hash) is complete
+    uint32_t hash_acc, frame_hash;
+    qemu_irq irq_frame;
+
+    gba_lcd_line line;
+    uint16_t line_out[GBA_LCD_WIDTH];
+
+    // Internal reference points of BG2 and BG3 (X, Y, X, Y), as of the line
+    // being rendered and as of the first line of the current vertical mosaic
+    // block; bit i of bg_ref_reload means bg_ref[i]'s register was written
+    int32_t bg_ref[4], bg_mosaic_ref[4];
+    uint8_t bg_ref_reload;
+
+    // BG palette decoded once for a whole batch of deferred lines, during
+    // which it cannot change (NULL outside of batches)
+    const uint16_t *batch_bg_colors;
+    uint16_t bg_colors[256];
+
+    bool deferred;
+    bool defer_frame;
+    // Whether the dirty log had uncollected modifications when saving
+    bool memory_dirty;
+    int defer_holdoff;
+    int batch_start;
+    uint16_t frame_regs[0x30];
+    gba_lcd_reg_write log[GBA_LCD_LOG_SIZE];
+    int log_count;
+    uint32_t epoch;
+    uint32_t line_epoch[GBA_LCD_HEIGHT];
+    uint8_t frame_palette[GBA_PALETTE_SIZE];
+    uint8_t frame_vram[GBA_VRAM_SIZE];
+    uint8_t frame_oam[GBA_OAM_SIZE];
+
+    gba_tile_entry *tiles;
+    uint32_t vram_gen[GBA_VRAM_BLOCKS];
+    uint64_t tile_hits, tile_misses;
+
+    uint32_t *pixel_lut;
+    int lut_bpp;
+    bool lut_bgr;
+
+    uint32_t *shadow;
+    uint32_t shadow_gen[GBA_LCD_HEIGHT];
+    bool shadow_valid[GBA_LCD_HEIGHT];
+    // Lines of the shared surface changed during the current frame
+    int update_first, update_last;
 } gba_lcd_state;
 
 
-static void gba_lcd_update_current_line(gba_lcd_state *s)
+static uint16_t gba_lcd_bg_color(gba_lcd_state *s, int index)
+{
+    return lduw_le_p(s->palette + index * 2) & 0x7fff;
+}
+
+
+static uint16_t gba_lcd_obj_color(gba_lcd_state *s, int index)
+{
+    return lduw_le_p(s->palette + 0x200 + index * 2) & 0x7fff;
+}
+
+
+/*
+ * Returns the decoded tile at the given VRAM address (a multiple of 32),
+ * optionally flipped horizontally. 8 bpp OBJ tiles may start in the middle of
+ * a 64 byte unit, so their second half may lie in the next VRAM block, or
+ * (for the very last tile) wrap around to the start of OBJ VRAM.
+ */
+static const uint8_t *gba_lcd_tile(gba_lcd_state *s, uint32_t addr, bool bpp8,
+                                   bool hflip)
+{
+    uint32_t tag = addr | (bpp8 ? GBA_TILE_8BPP : 0) | GBA_TILE_VALID;
+    uint32_t gen = s->vram_gen[addr / GBA_VRAM_BLOCK_SIZE];
+    gba_tile_entry *e = &s->tiles[(addr / 32) * 2 + (bpp8 ? 1 : 0)];
+    const uint8_t *src = s->vram + addr, *src_hi = NULL;
+    int i;
+
+    if (bpp8) {
+        uint32_t addr_hi = addr + 32;
+        if (addr_hi == GBA_VRAM_SIZE) {
+            addr_hi = 0x10000;
+        }
+        src_hi = s->vram + addr_hi;
+
+        // Generations only ever increase, so their sum does as well
+        if (addr_hi / GBA_VRAM_BLOCK_SIZE != addr / GBA_VRAM_BLOCK_SIZE) {
+            gen += s->vram_gen[addr_hi / GBA_VRAM_BLOCK_SIZE];
+        }
+    }
+
+    if (e->tag == tag) {
+        if (e->gen == gen) {
+            s->tile_hits++;
+            return e->pix[hflip];
+        }
+
+        // Something in the block has changed; maybe not this tile, though
+        if (!memcmp(e->raw, src, 32) &&
+            (!bpp8 || !memcmp(e->raw + 32, src_hi, 32)))
+        {
+            e->gen = gen;
+            s->tile_hits++;
+            return e->pix[hflip];
+        }
+    }
+
+    s->tile_misses++;
+
+    e->tag = tag;
+    e->gen = gen;
+    memcpy(e->raw, src, 32);
+
+    if (bpp8) {
+        memcpy(e->raw + 32, src_hi, 32);
+        memcpy(e->pix[0], e->raw, 64);
+    } else {
+        for (i = 0; i < 32; i++) {
+            e->pix[0][i * 2]     = src[i] & 0xf;
+            e->pix[0][i * 2 + 1] = src[i] >> 4;
+        }
+    }
+
+    for (i = 0; i < 64; i++) {
+        e->pix[1][i] = e->pix[0][(i & ~7) | (7 - (i & 7))];
+    }
+
+    return e->pix[hflip];
+}
+
+
+/*
+ * Horizontal mosaic: Every pixel takes the color of the first pixel of its
+ * block.
+ */
+static void gba_lcd_mosaic_h(uint16_t *line, int size)
+{
+    int x;
+    for (x = 0; x < GBA_LCD_WIDTH; x++) {
+        line[x] = line[x - x % size];
+    }
+}
+
+
+/* BG2 in the bitmap modes (3 to 5) */
+static uint16_t gba_lcd_bitmap_pixel(gba_lcd_state *s, int mode,
+                                     const uint8_t *frame, int x, int y)
+{
+    switch (mode) {
+        case 3:
+            if ((x >= GBA_LCD_WIDTH) || (y >= GBA_LCD_HEIGHT)) {
+                return GBA_TRANSPARENT;
+            }
+            return lduw_le_p(frame + (y * GBA_LCD_WIDTH + x) * 2) & 0x7fff;
+
+        case 4:
+            if ((x >= GBA_LCD_WIDTH) || (y >= GBA_LCD_HEIGHT) ||
+                !frame[y * GBA_LCD_WIDTH + x])
+            {
+                return GBA_TRANSPARENT;
+            }
+            return gba_lcd_bg_color(s, frame[y * GBA_LCD_WIDTH + x]);
+
+        default:
+            if ((x >= 160) || (y >= 128)) {
+                return GBA_TRANSPARENT;
+            }
+            return lduw_le_p(frame + (y * 160 + x) * 2) & 0x7fff;
+    }
+}
+
+/*
+ * Affine BGs (BG2 and BG3): Like on the hardware, every line starts at an
+ * internal reference point, which is loaded from BGxX/BGxY at the top of the
+ * frame and whenever the guest writes those, and advanced by PB/PD after
+ * every line. Reference point writes are tracked separately from the register
+ * values, as writing the same value again still reloads the internal point.
+ */
+
+/* Returns the index into bg_ref of the BGxX/BGxY register at offset, or -1 */
+static int gba_lcd_ref_index(hwaddr offset)
+{
+    if ((offset >= 0x28) && (offset < 0x30)) {
+        return (offset - 0x28) >> 2;
+    } else if ((offset >= 0x38) && (offset < 0x40)) {
+        return 2 + ((offset - 0x38) >> 2);
+    }
+
+    return -1;
+}
+
+static void gba_lcd_ref_written(gba_lcd_state *s, hwaddr offset)
+{
+    int i = gba_lcd_ref_index(offset);
+
+    if (i >= 0) {
+        s->bg_ref_reload |= 1 << i;
+    }
+}
+
+static void gba_lcd_load_refs(gba_lcd_state *s, const uint16_t *regs, int y)
+{
+    int mosaic_v = ((LCD_REG(regs, 0x4c) >> 4) & 0xf) + 1;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        hwaddr ofs = 0x28 + (i / 2) * 0x10 + (i % 2) * 4;
+
+        if (!y || (s->bg_ref_reload & (1 << i))) {
+            // 28 bit signed fixed point
+            s->bg_ref[i] = (int32_t)((LCD_REG(regs, ofs) |
+                                      ((uint32_t)LCD_REG(regs, ofs + 2) << 16))
+                                     << 4) >> 4;
+        }
+        if (!(y % mosaic_v)) {
+            s->bg_mosaic_ref[i] = s->bg_ref[i];
+        }
+    }
+
+    s->bg_ref_reload = 0;
+}
+
+static void gba_lcd_step_refs(gba_lcd_state *s, const uint16_t *regs)
+{
+    int i;
+
+    // PB for X, PD for Y
+    for (i = 0; i < 4; i++) {
+        s->bg_ref[i] += (int16_t)LCD_REG(regs, 0x22 + (i / 2) * 0x10
+                                               + (i % 2) * 4);
+    }
+}
+
+/* Reference point of the current line, taking vertical mosaic into account */
+static void gba_lcd_affine_ref(gba_lcd_state *s, const uint16_t *regs, int bg,
+                               int32_t *x, int32_t *y)
+{
+    const int32_t *ref = (LCD_REG(regs, 0x08 + bg * 2) & (1 << 6))
+                       ? s->bg_mosaic_ref : s->bg_ref;
+
+    *x = ref[(bg - 2) * 2];
+    *y = ref[(bg - 2) * 2 + 1];
+}
+
+static void gba_lcd_draw_affine_bg(gba_lcd_state *s, const uint16_t *regs,
+                                   int bg, uint16_t *dst)
+{
+    uint16_t bgcnt = LCD_REG(regs, 0x08 + bg * 2);
+    const uint8_t *chars = s->vram + ((bgcnt >> 2) & 3) * 0x4000;
+    const uint8_t *map = s->vram + ((bgcnt >> 8) & 0x1f) * 0x800;
+    bool wrap = bgcnt & (1 << 13);
+    int size = 128 << (bgcnt >> 14);
+    int32_t pa = (int16_t)LCD_REG(regs, 0x20 + (bg - 2) * 0x10);
+    int32_t pc = (int16_t)LCD_REG(regs, 0x24 + (bg - 2) * 0x10);
+    int32_t tx, ty;
+    int x;
+
+    gba_lcd_affine_ref(s, regs, bg, &tx, &ty);
+
+    // Always 8 bpp, with one byte (the tile number) per map entry
+    for (x = 0; x < GBA_LCD_WIDTH; x++, tx += pa, ty += pc) {
+        int px = tx >> 8, py = ty >> 8;
+
+        if (wrap) {
+            px &= size - 1;
+            py &= size - 1;
+        } else if ((px < 0) || (py < 0) || (px >= size) || (py >= size)) {
+            dst[x] = GBA_TRANSPARENT;
+            continue;
+        }
+
+        uint8_t tile = map[(py / 8) * (size / 8) + px / 8];
+        uint8_t pix = chars[tile * 64 + (py & 7) * 8 + (px & 7)];
+
+        dst[x] = pix ? gba_lcd_bg_color(s, pix) : GBA_TRANSPARENT;
+    }
+}
+
+/* BG2 in the bitmap modes is an affine BG as well */
+static void gba_lcd_draw_bitmap(gba_lcd_state *s, const uint16_t *regs,
+                                uint16_t *dst)
+{
+    uint16_t dispcnt = LCD_REG(regs, 0x00);
+    int mode = dispcnt & 7;
+    const uint8_t *frame = s->vram;
+    int x;
+
+    if ((mode != 3) && (dispcnt & (1 << 4))) {
+        frame += 0xa000;
+    }
+
+    int32_t pa = (int16_t)LCD_REG(regs, 0x20);
+    int32_t pc = (int16_t)LCD_REG(regs, 0x24);
+    int32_t tx, ty;
+
+    gba_lcd_affine_ref(s, regs, 2, &tx, &ty);
+
+    for (x = 0; x < GBA_LCD_WIDTH; x++, tx += pa, ty += pc) {
+        // Bitmaps do not wrap around
+        if ((tx < 0) || (ty < 0)) {
+            dst[x] = GBA_TRANSPARENT;
+        } else {
+            dst[x] = gba_lcd_bitmap_pixel(s, mode, frame, tx >> 8, ty >> 8);
+        }
+    }
+}
+
+
+static void gba_lcd_draw_text_bg(gba_lcd_state *s, const uint16_t *regs,
+                                 int y, int bg, uint16_t *dst)
+{
+    uint16_t bgcnt = LCD_REG(regs, 0x08 + bg * 2);
+    int hofs = LCD_REG(regs, 0x10 + bg * 4) & 0x1ff;
+    int vofs = LCD_REG(regs, 0x12 + bg * 4) & 0x1ff;
+    uint32_t char_base = ((bgcnt >> 2) & 3) * 0x4000;
+    uint32_t screen_base = ((bgcnt >> 8) & 0x1f) * 0x800;
+    bool bpp8 = bgcnt & (1 << 7);
+    int size = bgcnt >> 14;
+    int width = (size & 1) ? 512 : 256, height = (size & 2) ? 512 : 256;
+    int x, i;
+
+    const uint16_t *colors = s->batch_bg_colors;
+
+    // Screen blocks are 256x256 pixels; in 512x512 BGs, there are two per row
+    int map_y = (y + vofs) & (height - 1);
+    uint32_t row_base = screen_base + ((map_y & 255) / 8) * 64
+                      + (map_y / 256) * ((size == 3) ? 0x1000 : 0x800);
+    int tile_y = map_y & 7;
+
+    for (x = -(hofs & 7); x < GBA_LCD_WIDTH; x += 8) {
+        int map_x = (x + hofs) & (width - 1);
+        uint16_t entry = lduw_le_p(s->vram + row_base + (map_x / 256) * 0x800
+                                   + ((map_x & 255) / 8) * 2);
+
+        uint32_t addr = char_base + (entry & 0x3ff) * (bpp8 ? 64 : 32);
+        int row = (entry & (1 << 11)) ? 7 - tile_y : tile_y;
+        int pal = bpp8 ? 0 : (entry >> 12) * 16;
+
+        // BG tiles cannot come from OBJ VRAM
+        const uint8_t *pix = NULL;
+        if (addr < 0x10000) {
+            pix = gba_lcd_tile(s, addr, bpp8, entry & (1 << 10)) + row * 8;
+        }
+
+        // Tiles fully on the screen need neither bounds nor palette reads
+        if (colors && pix && (x >= 0) && (x + 8 <= GBA_LCD_WIDTH)) {
+            for (i = 0; i < 8; i++) {
+                dst[x + i] = pix[i] ? colors[pal + pix[i]] : GBA_TRANSPARENT;
+            }
+            continue;
+        }
+
+        for (i = 0; i < 8; i++) {
+            if ((x + i < 0) || (x + i >= GBA_LCD_WIDTH)) {
+                continue;
+            }
+            dst[x + i] = (pix && pix[i]) ? gba_lcd_bg_color(s, pal + pix[i])
+                                         : GBA_TRANSPARENT;
+        }
+    }
+}
+
+
+static void gba_lcd_draw_bg(gba_lcd_state *s, const uint16_t *regs, int y,
+                            int bg)
+{
+    uint16_t bgcnt = LCD_REG(regs, 0x08 + bg * 2);
+    uint16_t mosaic = LCD_REG(regs, 0x4c);
+    uint16_t *dst = s->line.bg[bg];
+
+    if (bgcnt & (1 << 6)) {
+        y -= y % (((mosaic >> 4) & 0xf) + 1);
+    }
+
+    int mode = LCD_REG(regs, 0x00) & 7;
+
+    // Only BGs existing in the mode are ever drawn
+    if ((mode == 0) || ((mode == 1) && (bg < 2))) {
+        gba_lcd_draw_text_bg(s, regs, y, bg, dst);
+    } else if (mode >= 3) {
+        gba_lcd_draw_bitmap(s, regs, dst);
+    } else {
+        gba_lcd_draw_affine_bg(s, regs, bg, dst);
+    }
+
+    if ((bgcnt & (1 << 6)) && (mosaic & 0xf)) {
+        gba_lcd_mosaic_h(dst, (mosaic & 0xf) + 1);
+    }
+}
+
+
+/* Puts one pixel (palette index pix) of an OBJ into the OBJ line buffers */
+static void gba_lcd_put_obj_pixel(gba_lcd_state *s, int x, uint8_t pix,
+                                  int mode, int prio, int pal)
+{
+    gba_lcd_line *l = &s->line;
+
+    if (!pix) {
+        return;
+    }
+
+    if (mode == 2) {
+        l->obj_attr[x] |= GBA_OBJ_WINDOW;
+        l->obj_window = true;
+        return;
+    }
+
+    // Lower OAM indices win on equal priority
+    if (!(l->obj[x] & GBA_TRANSPARENT) && ((l->obj_attr[x] & 3) <= prio)) {
+        return;
+    }
+
+    l->obj[x] = gba_lcd_obj_color(s, pal + pix);
+    l->obj_attr[x] = (l->obj_attr[x] & GBA_OBJ_WINDOW) | prio;
+    if (mode == 1) {
+        l->obj_attr[x] |= GBA_OBJ_SEMI_TRANS;
+        l->obj_semi_trans = true;
+    }
+}
+
+/*
+ * Tile numbers are in units of 32 bytes, even for 8 bpp OBJs; with 2D
+ * mapping, OBJ VRAM is a matrix of 32x32 such units. Returns the tile holding
+ * row ty of tile column tx of an OBJ w pixels wide, or -1 if it lies in the
+ * part of OBJ VRAM used by BG2 in the bitmap modes.
+ */
+static int gba_lcd_obj_tile(uint16_t attr2, int w, bool bpp8, bool map_1d,
+                            int min_tile, int tx, int ty)
+{
+    int step = bpp8 ? 2 : 1;
+    int t = ((attr2 & 0x3ff) + (ty / 8) * (map_1d ? (w / 8) * step : 32)
+             + tx * step) & 0x3ff;
+
+    return (t < min_tile) ? -1 : t;
+}
+
+/*
+ * OBJs with mosaic or an affine transformation are drawn pixel by pixel,
+ * mapping every pixel of the (possibly doubled) bounding box back to the OBJ.
+ */
+static void gba_lcd_draw_obj_slow(gba_lcd_state *s, const uint16_t *regs,
+                                  uint16_t attr0, uint16_t attr1,
+                                  uint16_t attr2, int w, int h, int ox,
+                                  int row, int min_tile)
+{
+    bool affine = attr0 & (1 << 8);
+    int bw = w, bh = h;
+    int32_t pa = 0x100, pb = 0, pc = 0, pd = 0x100;
+    int mosaic_h = 1;
+    int bx;
+
+    if (affine) {
+        const uint8_t *params = s->oam + ((attr1 >> 9) & 0x1f) * 32;
+
+        pa = (int16_t)lduw_le_p(params + 0x06);
+        pb = (int16_t)lduw_le_p(params + 0x0e);
+        pc = (int16_t)lduw_le_p(params + 0x16);
+        pd = (int16_t)lduw_le_p(params + 0x1e);
+
+        if (attr0 & (1 << 9)) {
+            bw *= 2;
+            bh *= 2;
+        }
+    }
+
+    if (attr0 & (1 << 12)) {
+        mosaic_h = ((LCD_REG(regs, 0x4c) >> 8) & 0xf) + 1;
+    }
+
+    bool bpp8 = attr0 & (1 << 13);
+    bool map_1d = LCD_REG(regs, 0x00) & (1 << 6);
+    int mode = (attr0 >> 10) & 3;
+    int prio = (attr2 >> 10) & 3;
+    int pal = bpp8 ? 0 : (attr2 >> 12) * 16;
+
+    for (bx = 0; bx < bw; bx++) {
+        int x = ox + bx, sx = bx, tx, ty;
+
+        if ((x < 0) || (x >= GBA_LCD_WIDTH)) {
+            continue;
+        }
+
+        // Horizontal mosaic blocks are aligned to the screen, not to the OBJ
+        if (mosaic_h > 1) {
+            sx = MAX(x - x % mosaic_h - ox, 0);
+        }
+
+        if (affine) {
+            int dx = sx - bw / 2, dy = row - bh / 2;
+
+            tx = ((pa * dx + pb * dy) >> 8) + w / 2;
+            ty = ((pc * dx + pd * dy) >> 8) + h / 2;
+            if ((tx < 0) || (ty < 0) || (tx >= w) || (ty >= h)) {
+                continue;
+            }
+        } else {
+            tx = (attr1 & (1 << 12)) ? w - 1 - sx : sx;
+            ty = (attr1 & (1 << 13)) ? h - 1 - row : row;
+        }
+
+        int t = gba_lcd_obj_tile(attr2, w, bpp8, map_1d, min_tile, tx / 8,
+                                 ty);
+        if (t < 0) {
+            continue;
+        }
+
+        const uint8_t *pix = gba_lcd_tile(s, 0x10000 + t * 32, bpp8, false);
+        gba_lcd_put_obj_pixel(s, x, pix[(ty & 7) * 8 + (tx & 7)], mode, prio,
+                              pal);
+    }
+}
+
+static void gba_lcd_draw_objs(gba_lcd_state *s, const uint16_t *regs, int y)
+{
+    static const int obj_sizes[3][4][2] = {
+        { {  8,  8 }, { 16, 16 }, { 32, 32 }, { 64, 64 } }, // Square
+        { { 16,  8 }, { 32,  8 }, { 32, 16 }, { 64, 32 } }, // Horizontal
+        { {  8, 16 }, {  8, 32 }, { 16, 32 }, { 32, 64 } }, // Vertical
+    };
+
+    gba_lcd_line *l = &s->line;
+    uint16_t dispcnt = LCD_REG(regs, 0x00);
+    bool map_1d = dispcnt & (1 << 6);
+    // In the bitmap modes, the lower half of OBJ VRAM is used by BG2
+    int min_tile = ((dispcnt & 7) >= 3) ? 512 : 0;
+    // Vertical OBJ mosaic uses the first line of each block on the screen
+    int mosaic_v = ((LCD_REG(regs, 0x4c) >> 12) & 0xf) + 1;
+    int i, x, tx;
+
+    for (x = 0; x < GBA_LCD_WIDTH; x++) {
+        l->obj[x] = GBA_TRANSPARENT;
+        l->obj_attr[x] = 0;
+    }
+
+    for (i = 0; i < 128; i++) {
+        uint16_t attr0 = lduw_le_p(s->oam + i * 8);
+        uint16_t attr1 = lduw_le_p(s->oam + i * 8 + 2);
+        uint16_t attr2 = lduw_le_p(s->oam + i * 8 + 4);
+        int shape = (attr0 >> 14) & 3, mode = (attr0 >> 10) & 3;
+        bool affine = attr0 & (1 << 8);
+        bool mosaic = attr0 & (1 << 12);
+
+        // Skip disabled, prohibited and invalid OBJs
+        if ((!affine && (attr0 & (1 << 9))) || (mode == 3) || (shape == 3)) {
+            continue;
+        }
+
+        int w = obj_sizes[shape][attr1 >> 14][0];
+        int h = obj_sizes[shape][attr1 >> 14][1];
+        // Affine OBJs may be drawn in a bounding box of double the size
+        int scale = (affine && (attr0 & (1 << 9))) ? 2 : 1;
+
+        int line = mosaic ? y - y % mosaic_v : y;
+        int row = (line - (attr0 & 0xff)) & 0xff;
+        if (row >= h * scale) {
+            continue;
+        }
+
+        int ox = attr1 & 0x1ff;
+        if (ox >= GBA_LCD_WIDTH) {
+            ox -= 512;
+        }
+        if ((ox + w * scale <= 0) || (ox >= GBA_LCD_WIDTH)) {
+            continue;
+        }
+
+        if (affine || mosaic) {
+            gba_lcd_draw_obj_slow(s, regs, attr0, attr1, attr2, w, h, ox, row,
+                                  min_tile);
+            continue;
+        }
+
+        bool bpp8 = attr0 & (1 << 13);
+        bool hflip = attr1 & (1 << 12);
+        int prio = (attr2 >> 10) & 3;
+        int pal = bpp8 ? 0 : (attr2 >> 12) * 16;
+
+        if (attr1 & (1 << 13)) {
+            row = h - 1 - row;
+        }
+
+        // Regular OBJs are drawn one tile row (eight pixels) at a time
+        for (tx = 0; tx < w / 8; tx++) {
+            int t = gba_lcd_obj_tile(attr2, w, bpp8, map_1d, min_tile,
+                                     hflip ? w / 8 - 1 - tx : tx, row);
+            int px;
+
+            if (t < 0) {
+                continue;
+            }
+
+            const uint8_t *pix = gba_lcd_tile(s, 0x10000 + t * 32, bpp8, hflip)
+                               + (row & 7) * 8;
+
+            for (px = 0; px < 8; px++) {
+                x = ox + tx * 8 + px;
+                if ((x >= 0) && (x < GBA_LCD_WIDTH)) {
+                    gba_lcd_put_obj_pixel(s, x, pix[px], mode, prio, pal);
+                }
+            }
+        }
+    }
+}
+
+
+static bool gba_lcd_window_contains(uint16_t bounds, int pos)
+{
+    int start = bounds >> 8, end = bounds & 0xff;
+
+    if (start <= end) {
+        return (pos >= start) && (pos < end);
+    } else {
+        return (pos >= start) || (pos < end);
+    }
+}
+
+static void gba_lcd_window_fill(uint8_t *ctrl, uint16_t bounds, uint8_t value)
+{
+    int start = bounds >> 8, end = bounds & 0xff;
+
+    if (start <= end) {
+        start = MIN(start, GBA_LCD_WIDTH);
+        end   = MIN(end,   GBA_LCD_WIDTH);
+        memset(ctrl + start, value, end - start);
+    } else {
+        memset(ctrl, value, MIN(end, GBA_LCD_WIDTH));
+        if (start < GBA_LCD_WIDTH) {
+            memset(ctrl + start, value, GBA_LCD_WIDTH - start);
+        }
+    }
+}
+
+/*
+ * Splits the line into spans of pixels sharing the same window control bits.
+ * Without any windows, that is just one span covering the whole line.
+ */
+static int gba_lcd_build_spans(gba_lcd_state *s, const uint16_t *regs, int y)
+{
+    gba_lcd_line *l = &s->line;
+    uint16_t dispcnt = LCD_REG(regs, 0x00);
+    uint16_t winin = LCD_REG(regs, 0x48), winout = LCD_REG(regs, 0x4a);
+
+    if (!(dispcnt & 0xe000)) {
+        l->spans[0] = (gba_lcd_span){ 0, GBA_LCD_WIDTH, 0x3f };
+        return 1;
+    }
+
+    uint8_t ctrl[GBA_LCD_WIDTH];
+    memset(ctrl, winout & 0x3f, sizeof(ctrl));
+
+    int x;
+    if ((dispcnt & (1 << 15)) && l->obj_window) {
+        for (x = 0; x < GBA_LCD_WIDTH; x++) {
+            if (l->obj_attr[x] & GBA_OBJ_WINDOW) {
+                ctrl[x] = (winout >> 8) & 0x3f;
+            }
+        }
+    }
+
+    // WIN0 has priority over WIN1, which has priority over the OBJ window
+    if ((dispcnt & (1 << 14)) &&
+        gba_lcd_window_contains(LCD_REG(regs, 0x46), y))
+    {
+        gba_lcd_window_fill(ctrl, LCD_REG(regs, 0x42), (winin >> 8) & 0x3f);
+    }
+    if ((dispcnt & (1 << 13)) &&
+        gba_lcd_window_contains(LCD_REG(regs, 0x44), y))
+    {
+        gba_lcd_window_fill(ctrl, LCD_REG(regs, 0x40), winin & 0x3f);
+    }
+
+    int count = 0;
+    for (x = 0; x < GBA_LCD_WIDTH; x++) {
+        if (!count || (ctrl[x] != l->spans[count - 1].ctrl)) {
+            l->spans[count++] = (gba_lcd_span){ x, x + 1, ctrl[x] };
+        } else {
+            l->spans[count - 1].x1 = x + 1;
+        }
+    }
+
+    return count;
+}
+
+
+/*
+ * Color effects, eight pixels at a time. Coefficients are 0..16, so all
+ * intermediate values fit into 16 bits.
+ */
+
+typedef uint16_t gba_pixvec __attribute__((vector_size(16)));
+#define GBA_PIXVEC_LEN ((int)(sizeof(gba_pixvec) / sizeof(uint16_t)))
+
+static gba_pixvec gba_pixvec_load(const uint16_t *src)
+{
+    gba_pixvec v;
+    memcpy(&v, src, sizeof(v));
+    return v;
+}
+
+static void gba_pixvec_store(uint16_t *dst, gba_pixvec v)
+{
+    memcpy(dst, &v, sizeof(v));
+}
+
+static gba_pixvec gba_pixvec_alpha(gba_pixvec a, gba_pixvec b,
+                                   uint16_t eva, uint16_t evb)
+{
+    gba_pixvec r = ( (a        & 0x1f) * eva +  (b        & 0x1f) * evb) >> 4;
+    gba_pixvec g = (((a >>  5) & 0x1f) * eva + ((b >>  5) & 0x1f) * evb) >> 4;
+    gba_pixvec c = (((a >> 10) & 0x1f) * eva + ((b >> 10) & 0x1f) * evb) >> 4;
+
+    // Saturate at 31 (the sums are at most 62)
+    r = (r | ((r >> 5) * 31)) & 0x1f;
+    g = (g | ((g >> 5) * 31)) & 0x1f;
+    c = (c | ((c >> 5) * 31)) & 0x1f;
+
+    return r | (g << 5) | (c << 10);
+}
+
+static gba_pixvec gba_pixvec_brighten(gba_pixvec a, uint16_t evy)
+{
+    gba_pixvec r =  a        & 0x1f;
+    gba_pixvec g = (a >>  5) & 0x1f;
+    gba_pixvec c = (a >> 10) & 0x1f;
+
+    r += ((31 - r) * evy) >> 4;
+    g += ((31 - g) * evy) >> 4;
+    c += ((31 - c) * evy) >> 4;
+
+    return r | (g << 5) | (c << 10);
+}
+
+static gba_pixvec gba_pixvec_darken(gba_pixvec a, uint16_t evy)
+{
+    gba_pixvec r =  a        & 0x1f;
+    gba_pixvec g = (a >>  5) & 0x1f;
+    gba_pixvec c = (a >> 10) & 0x1f;
+
+    r -= (r * evy) >> 4;
+    g -= (g * evy) >> 4;
+    c -= (c * evy) >> 4;
+
+    return r | (g << 5) | (c << 10);
+}
+
+static void gba_lcd_blend(uint16_t *dst, const uint16_t *top,
+                          const uint16_t *bot, int n, int op,
+                          uint16_t eva, uint16_t evb, uint16_t evy)
+{
+    uint16_t tail_top[GBA_PIXVEC_LEN], tail_bot[GBA_PIXVEC_LEN];
+    int i;
+
+    for (i = 0; i < n; i += GBA_PIXVEC_LEN) {
+        int len = MIN(n - i, GBA_PIXVEC_LEN);
+        gba_pixvec a, b, r;
+
+        if (len == GBA_PIXVEC_LEN) {
+            a = gba_pixvec_load(top + i);
+            b = gba_pixvec_load(bot + i);
+        } else {
+            memset(tail_top, 0, sizeof(tail_top));
+            memset(tail_bot, 0, sizeof(tail_bot));
+            memcpy(tail_top, top + i, len * sizeof(uint16_t));
+            memcpy(tail_bot, bot + i, len * sizeof(uint16_t));
+            a = gba_pixvec_load(tail_top);
+            b = gba_pixvec_load(tail_bot);
+        }
+
+        switch (op) {
+            case GBA_EFFECT_ALPHA:
+                r = gba_pixvec_alpha(a, b, eva, evb);
+                break;
+            case GBA_EFFECT_BRIGHTEN:
+                r = gba_pixvec_brighten(a, evy);
+                break;
+            default:
+                r = gba_pixvec_darken(a, evy);
+                break;
+        }
+
+        if (len == GBA_PIXVEC_LEN) {
+            gba_pixvec_store(dst + i, r);
+        } else {
+            gba_pixvec_store(tail_top, r);
+            memcpy(dst + i, tail_top, len * sizeof(uint16_t));
+        }
+    }
+}
+
+
+/*
+ * Composes the layers of one span. Spans without color effects only need the
+ * topmost layer and are written directly; everything else first resolves the
+ * two topmost layers and the effect for each pixel and then blends runs of
+ * pixels with the same effect in one go.
+ */
+static void gba_lcd_compose_span(gba_lcd_state *s, const uint16_t *regs,
+                                 const gba_lcd_span *span, unsigned layers,
+                                 const int *order, int order_count,
+                                 uint16_t *out)
+{
+    gba_lcd_line *l = &s->line;
+    uint16_t bldcnt = LCD_REG(regs, 0x50);
+    int effect = (bldcnt >> 6) & 3;
+    uint16_t backdrop = gba_lcd_bg_color(s, 0);
+    int x;
+
+    layers &= span->ctrl;
+
+    bool effects = (span->ctrl & (1 << 5)) &&
+                   ((effect != GBA_EFFECT_NONE) ||
+                    ((layers & (1 << GBA_LAYER_OBJ)) && l->obj_semi_trans));
+
+    for (x = span->x0; x < span->x1; x++) {
+        bool obj = (layers & (1 << GBA_LAYER_OBJ)) &&
+                   !(l->obj[x] & GBA_TRANSPARENT);
+        int obj_prio = l->obj_attr[x] & 3;
+
+        uint16_t color[2] = { backdrop, backdrop };
+        uint8_t id[2] = { GBA_LAYER_BD, GBA_LAYER_BD };
+        int n = 0, k;
+
+        for (k = 0; (k < order_count) && (n < (effects ? 2 : 1)); k++) {
+            int bg = order[k];
+
+            if (obj && (obj_prio <= (LCD_REG(regs, 0x08 + bg * 2) & 3))) {
+                color[n] = l->obj[x];
+                id[n++] = GBA_LAYER_OBJ;
+                obj = false;
+                if (n == (effects ? 2 : 1)) {
+                    break;
+                }
+            }
+
+            if ((layers & (1 << bg)) && !(l->bg[bg][x] & GBA_TRANSPARENT)) {
+                color[n] = l->bg[bg][x];
+                id[n++] = bg;
+            }
+        }
+        if (obj && (n < 2)) {
+            color[n] = l->obj[x];
+            id[n++] = GBA_LAYER_OBJ;
+        }
+
+        if (!effects) {
+            out[x] = color[0];
+            continue;
+        }
+
+        bool first = bldcnt & (1 << id[0]);
+        bool second = bldcnt & (1 << (id[1] + 8));
+        bool semi = (id[0] == GBA_LAYER_OBJ) &&
+                    (l->obj_attr[x] & GBA_OBJ_SEMI_TRANS);
+
+        l->top[x] = color[0];
+        l->bot[x] = color[1];
+
+        if ((semi || ((effect == GBA_EFFECT_ALPHA) && first)) && second) {
+            l->op[x] = GBA_EFFECT_ALPHA;
+        } else if ((effect >= GBA_EFFECT_BRIGHTEN) && first) {
+            l->op[x] = effect;
+        } else {
+            l->op[x] = GBA_EFFECT_NONE;
+        }
+    }
+
+    if (!effects) {
+        return;
+    }
+
+    uint16_t bldalpha = LCD_REG(regs, 0x52);
+    uint16_t eva = MIN(bldalpha & 0x1f, 16);
+    uint16_t evb = MIN((bldalpha >> 8) & 0x1f, 16);
+    uint16_t evy = MIN(LCD_REG(regs, 0x54) & 0x1f, 16);
+
+    for (x = span->x0; x < span->x1;) {
+        int end = x + 1;
+        while ((end < span->x1) && (l->op[end] == l->op[x])) {
+            end++;
+        }
+
+        if (l->op[x] == GBA_EFFECT_NONE) {
+            memcpy(out + x, l->top + x, (end - x) * sizeof(uint16_t));
+        } else {
+            gba_lcd_blend(out + x, l->top + x, l->bot + x, end - x, l->op[x],
+                          eva, evb, evy);
+        }
+
+        x = end;
+    }
+}
+
+
+static void gba_lcd_compose_line(gba_lcd_state *s, const uint16_t *regs, int y,
+                                 uint16_t *out)
+{
+    // BGs available in each mode
+    static const unsigned mode_bgs[8] = { 0xf, 0x7, 0xc, 0x4, 0x4, 0x4 };
+
+    uint16_t dispcnt = LCD_REG(regs, 0x00);
+    gba_lcd_line *l = &s->line;
+    unsigned layers = 0;
+    int bg, i;
+
+    l->obj_semi_trans = false;
+    l->obj_window = false;
+
+    for (bg = 0; bg < 4; bg++) {
+        if ((dispcnt & (1 << (8 + bg))) &&
+            (mode_bgs[dispcnt & 7] & (1 << bg)))
+        {
+            gba_lcd_draw_bg(s, regs, y, bg);
+            layers |= 1 << bg;
+        }
+    }
+
+    if (dispcnt & (1 << 12)) {
+        gba_lcd_draw_objs(s, regs, y);
+        layers |= 1 << GBA_LAYER_OBJ;
+    }
+
+    // BGs in drawing order (by priority, then by number)
+    int order[4], order_count = 0, prio;
+    for (prio = 0; prio < 4; prio++) {
+        for (bg = 0; bg < 4; bg++) {
+            if ((layers & (1 << bg)) &&
+                ((LCD_REG(regs, 0x08 + bg * 2) & 3) == prio))
+            {
+                order[order_count++] = bg;
+            }
+        }
+    }
+
+    int span_count = gba_lcd_build_spans(s, regs, y);
+    for (i = 0; i < span_count; i++) {
+        gba_lcd_compose_span(s, regs, &l->spans[i], layers, order, order_count,
+                             out);
+    }
+}
+
+/* Renders line y into out (BGR555), with the reference points loaded */
+static void gba_lcd_render_line(gba_lcd_state *s, const uint16_t *regs, int y,
+                                uint16_t *out)
+{
+    int i;
+
+    if (LCD_REG(regs, 0x00) & (1 << 7)) {
+        // Forced blank
+        for (i = 0; i < GBA_LCD_WIDTH; i++) {
+            out[i] = 0x7fff;
+        }
+    } else {
+        gba_lcd_compose_line(s, regs, y, out);
+    }
+}
+
+
+/*
+ * Output goes through a lookup table mapping every BGR555 color to a pixel in
+ * the display surface's format, which is rebuilt whenever that format changes.
+ */
+static void gba_lcd_update_lut(gba_lcd_state *s, DisplaySurface *sfc)
+{
+    int bpp = surface_bits_per_pixel(sfc);
+    bool bgr = is_surface_bgr(sfc);
+    int c;
+
+    if ((bpp == s->lut_bpp) && (bgr == s->lut_bgr)) {
+        return;
+    }
+
+    for (c = 0; c < 0x8000; c++) {
+        uint8_t r = (c << 3) & 0xf8, g = (c >> 2) & 0xf8, b = (c >> 7) & 0xf8;
+
+        switch (bpp) {
+            case 8:
+                s->pixel_lut[c] = rgb_to_pixel8(r, g, b);
+                break;
+            case 15:
+                s->pixel_lut[c] = bgr ? rgb_to_pixel15bgr(r, g, b)
+                                      : rgb_to_pixel15(r, g, b);
+                break;
+            case 16:
+                s->pixel_lut[c] = bgr ? rgb_to_pixel16bgr(r, g, b)
+                                      : rgb_to_pixel16(r, g, b);
+                break;
+            case 24:
+                s->pixel_lut[c] = bgr ? rgb_to_pixel24bgr(r, g, b)
+                                      : rgb_to_pixel24(r, g, b);
+                break;
+            default:
+                s->pixel_lut[c] = bgr ? rgb_to_pixel32bgr(r, g, b)
+                                      : rgb_to_pixel32(r, g, b);
+                break;
+        }
+    }
+
+    s->lut_bpp = bpp;
+    s->lut_bgr = bgr;
+}
+
+static void gba_lcd_put_pixels(gba_lcd_state *s, uint8_t *dst,
+                               const uint16_t *src, int count)
+{
+    int x;
+
+    switch (s->lut_bpp) {
+        case 8:
+            for (x = 0; x < count; x++) {
+                dst[x] = s->pixel_lut[src[x]];
+            }
+            break;
+
+        case 15:
+        case 16:
+            for (x = 0; x < count; x++) {
+                ((uint16_t *)dst)[x] = s->pixel_lut[src[x]];
+            }
+            break;
+
+        case 24:
+            for (x = 0; x < count; x++) {
+                uint32_t pixel = s->pixel_lut[src[x]];
+                dst[x * 3]     = pixel;
+                dst[x * 3 + 1] = pixel >> 8;
+                dst[x * 3 + 2] = pixel >> 16;
+            }
+            break;
+
+        default:
+            for (x = 0; x < count; x++) {
+                ((uint32_t *)dst)[x] = s->pixel_lut[src[x]];
+            }
+            break;
+    }
+}
+
+
+/*
+ * Plain mode 3 lines (see below) are not drawn at all: Instead, the display
+ * surface is made to point to a shadow buffer holding the mode 3 frame buffer
+ * in host format. Each line of it remembers the generations of the VRAM
+ * blocks it was converted from, so only lines modified since are converted
+ * again, and only lines that changed during a frame are reported as updated.
+ * Whether to use the shadow buffer is decided at the top of every frame, so
+ * that all lines of a frame end up on the same surface; lines of a shared
+ * frame that are not plain are drawn into the shadow buffer like into any
+ * other surface (and have to be converted again later).
+ */
+static void gba_lcd_set_shared(gba_lcd_state *s, bool shared)
+{
+    DisplaySurface *sfc = qemu_console_surface(s->con);
+
+    if (is_buffer_shared(sfc) == shared) {
+        return;
+    }
+
+    if (shared) {
+        sfc = qemu_create_displaysurface_from(GBA_LCD_WIDTH, GBA_LCD_HEIGHT,
+                                              32, GBA_LCD_WIDTH * 4,
+                                              (uint8_t *)s->shadow, false);
+        memset(s->shadow_valid, 0, sizeof(s->shadow_valid));
+    } else {
+        sfc = qemu_create_displaysurface(GBA_LCD_WIDTH, GBA_LCD_HEIGHT);
+    }
+
+    dpy_gfx_replace_surface(s->con, sfc);
+    gba_lcd_update_lut(s, sfc);
+}
+
+static void gba_lcd_shadow_updated(gba_lcd_state *s, int y)
+{
+    s->update_first = MIN(s->update_first, y);
+    s->update_last  = MAX(s->update_last, y);
+}
+
+/* Generation of mode 3 line y, in the way gba_lcd_tile() combines them */
+static uint32_t gba_lcd_mode3_line_gen(gba_lcd_state *s, int y)
+{
+    int b0 = y * GBA_LCD_WIDTH * 2 / GBA_VRAM_BLOCK_SIZE;
+    int b1 = ((y + 1) * GBA_LCD_WIDTH * 2 - 1) / GBA_VRAM_BLOCK_SIZE;
+
+    return s->vram_gen[b0] + ((b1 != b0) ? s->vram_gen[b1] : 0);
+}
+
+static void gba_lcd_sync_shadow_line(gba_lcd_state *s, int y)
 {
-    if (s->ly >= 160) {
+    const uint8_t *src = s->vram + y * GBA_LCD_WIDTH * 2;
+    uint32_t *dst = s->shadow + y * GBA_LCD_WIDTH;
+    uint32_t gen = gba_lcd_mode3_line_gen(s, y);
+    int x;
+
+    if (s->shadow_valid[y] && (s->shadow_gen[y] == gen)) {
         return;
     }
 
+    for (x = 0; x < GBA_LCD_WIDTH; x++) {
+        dst[x] = s->pixel_lut[lduw_le_p(src + x * 2) & 0x7fff];
+    }
+
+    s->shadow_gen[y] = gen;
+    s->shadow_valid[y] = true;
+    gba_lcd_shadow_updated(s, y);
+}
+
+
+/* Returns line y of the display surface, for drawing into */
+static uint8_t *gba_lcd_surface_line(gba_lcd_state *s, int y)
+{
     DisplaySurface *sfc = qemu_console_surface(s->con);
 
     if (is_buffer_shared(sfc)) {
-        return;
+        s->shadow_valid[y] = false;
+        gba_lcd_shadow_updated(s, y);
+    } else {
+        gba_lcd_update_lut(s, sfc);
+    }
+
+    return (uint8_t *)surface_data(sfc) + surface_stride(sfc) * y;
+}
+
+
+/*
+ * Frames are only hashed if someone wants to know (i.e. if the frame IRQ is
+ * connected), as that costs another pass over each line.
+ */
+static uint32_t gba_lcd_hash(uint32_t hash, uint16_t pixel)
+{
+    return (hash ^ pixel) * 16777619;
+}
+
+static void gba_lcd_hash_pixels(gba_lcd_state *s, const uint16_t *pixels,
+                                int count)
+{
+    uint32_t hash = s->hash_acc;
+    int x;
+
+    for (x = 0; x < count; x++) {
+        hash = gba_lcd_hash(hash, pixels[x]);
+    }
+
+    s->hash_acc = hash;
+}
+
+static void gba_lcd_hash_mode3_line(gba_lcd_state *s, int y)
+{
+    uint16_t line[GBA_LCD_WIDTH];
+    int x;
+
+    for (x = 0; x < GBA_LCD_WIDTH; x++) {
+        line[x] = lduw_le_p(s->vram + (y * GBA_LCD_WIDTH + x) * 2) & 0x7fff;
     }
+    gba_lcd_hash_pixels(s, line, GBA_LCD_WIDTH);
+}
+
+
+/*
+ * In mode 3 with only BG2 enabled (and no windows, mosaic, color effects or
+ * affine transformation on it), a line is just VRAM converted to the host
+ * format, which the shadow buffer already is. This checks everything but the
+ * reference point, which callers check themselves.
+ */
+static bool gba_lcd_plain_regs(const uint16_t *regs)
+{
+    static const uint16_t identity[4] = {
+        0x0100, 0x0000, 0x0000, 0x0100, // PA, PB, PC, PD
+    };
 
-    if ((surface_bits_per_pixel(sfc) != 32) || is_surface_bgr(sfc)) {
-        fprintf(stderr, "Unknown surface format (%i bpp %s)\n",
-                surface_bits_per_pixel(sfc),
-                is_surface_bgr(sfc) ? "BGR" : "RGB");
-        exit(1);
+    uint16_t bldcnt = LCD_REG(regs, 0x50);
+
+    return ((LCD_REG(regs, 0x00) & 0xff87) == 0x0403) &&
+           !(LCD_REG(regs, 0x0c) & (1 << 6)) &&
+           !(((bldcnt >> 6) & 3) && (bldcnt & (1 << GBA_LAYER_BG2))) &&
+           !memcmp(&LCD_REG(regs, 0x20), identity, sizeof(identity));
+}
+
+/*
+ * Draws line y. Lines must be drawn in order, as the affine reference points
+ * carry over from one line to the next.
+ */
+static void gba_lcd_draw_line(gba_lcd_state *s, const uint16_t *regs, int y)
+{
+    gba_lcd_load_refs(s, regs, y);
+
+    // The reference point has to be at the start of line y of the bitmap
+    bool plain = gba_lcd_plain_regs(regs) && !s->bg_ref[0] &&
+                 (s->bg_ref[1] == y << 8);
+
+    if (!y) {
+        gba_lcd_set_shared(s, plain);
     }
 
-    size_t stride = surface_stride(sfc);
-    uint8_t *data = (uint8_t *)surface_data(sfc) + stride * s->ly;
+    if (plain && is_buffer_shared(qemu_console_surface(s->con))) {
+        gba_lcd_sync_shadow_line(s, y);
 
-    if (s->forced_blank) {
-        memset(data, 255, surface_stride(sfc));
+        if (s->irq_frame) {
+            gba_lcd_hash_mode3_line(s, y);
+        }
     } else {
-        memset(data, 0, surface_stride(sfc));
+        uint8_t *data = gba_lcd_surface_line(s, y);
+
+        gba_lcd_render_line(s, regs, y, s->line_out);
+        gba_lcd_put_pixels(s, data, s->line_out, GBA_LCD_WIDTH);
+
+        if (s->irq_frame) {
+            gba_lcd_hash_pixels(s, s->line_out, GBA_LCD_WIDTH);
+        }
+    }
+
+    gba_lcd_step_refs(s, regs);
+}
+
+
+/*
+ * Without any raster effects, all lines of a frame are rendered with the same
+ * registers, so a plain frame can be synced without going through the lines.
+ */
+static bool gba_lcd_draw_plain_frame(gba_lcd_state *s, const uint16_t *regs)
+{
+    static const uint16_t zero[4];
+    int y;
+
+    // BG2X and BG2Y
+    if (!gba_lcd_plain_regs(regs) ||
+        memcmp(&LCD_REG(regs, 0x28), zero, sizeof(zero)))
+    {
+        return false;
+    }
+
+    gba_lcd_set_shared(s, true);
+
+    for (y = 0; y < GBA_LCD_HEIGHT; y++) {
+        gba_lcd_sync_shadow_line(s, y);
+
+        if (s->irq_frame) {
+            gba_lcd_hash_mode3_line(s, y);
+        }
+    }
+
+    return true;
+}
+
+
+/* Returns whether gba_lcd_check_dirty() would find any modification */
+static bool gba_lcd_memory_dirty(gba_lcd_state *s)
+{
+    if (memory_region_get_dirty(s->vram_mr, 0, GBA_VRAM_SIZE,
+                                DIRTY_MEMORY_VGA))
+    {
+        return true;
+    }
+
+    return s->deferred &&
+           (memory_region_get_dirty(s->palette_mr, 0, GBA_PALETTE_SIZE,
+                                    DIRTY_MEMORY_VGA) ||
+            memory_region_get_dirty(s->oam_mr, 0, GBA_OAM_SIZE,
+                                    DIRTY_MEMORY_VGA));
+}
+
+/*
+ * Picks up guest writes to VRAM (and, when rendering deferred, to OAM and the
+ * palette): Modified VRAM blocks get a new generation for the tile cache, and
+ * any modification at all starts a new memory epoch.
+ */
+static void gba_lcd_check_dirty(gba_lcd_state *s)
+{
+    bool dirty = false;
+    int i;
+
+    if (memory_region_get_dirty(s->vram_mr, 0, GBA_VRAM_SIZE,
+                                DIRTY_MEMORY_VGA))
+    {
+        for (i = 0; i < GBA_VRAM_BLOCKS; i++) {
+            if (memory_region_get_dirty(s->vram_mr, i * GBA_VRAM_BLOCK_SIZE,
+                                        GBA_VRAM_BLOCK_SIZE, DIRTY_MEMORY_VGA))
+            {
+                s->vram_gen[i]++;
+            }
+        }
+
+        memory_region_reset_dirty(s->vram_mr, 0, GBA_VRAM_SIZE,
+                                  DIRTY_MEMORY_VGA);
+        dirty = true;
+    }
+
+    if (s->deferred) {
+        MemoryRegion *mrs[] = { s->palette_mr, s->oam_mr };
+
+        for (i = 0; i < ARRAY_SIZE(mrs); i++) {
+            hwaddr size = memory_region_size(mrs[i]);
+
+            if (memory_region_get_dirty(mrs[i], 0, size, DIRTY_MEMORY_VGA)) {
+                memory_region_reset_dirty(mrs[i], 0, size, DIRTY_MEMORY_VGA);
+                dirty = true;
+            }
+        }
+    }
+
+    if (dirty) {
+        s->epoch++;
+    }
+}
+
+
+/*
+ * Renders all pending lines up to (excluding) end by replaying the log.
+ *
+ * If the memory has been modified since it was last checked, that happened
+ * after all pending lines had started (the check is done at the start of each
+ * line), so they are rendered from the copy made at the start of the frame.
+ * The VRAM generations are only bumped afterwards, so the tile cache and the
+ * shadow buffer stay consistent with that copy. Since the copy is outdated
+ * then, the rest of the frame is rendered line by line.
+ */
+static void gba_lcd_flush(gba_lcd_state *s, int end)
+{
+    const uint8_t *palette = s->palette, *vram = s->vram, *oam = s->oam;
+    bool dirty = gba_lcd_memory_dirty(s);
+    int y, i = 0;
+
+    if (dirty) {
+        s->palette = s->frame_palette;
+        s->vram    = s->frame_vram;
+        s->oam     = s->frame_oam;
+    }
+
+    if (s->batch_start || (end < GBA_LCD_HEIGHT) || s->log_count ||
+        !gba_lcd_draw_plain_frame(s, s->frame_regs))
+    {
+        // Memory is fixed for the batch, so the BG palette only needs to be
+        // decoded once for all of its lines
+        for (i = 0; i < 256; i++) {
+            s->bg_colors[i] = gba_lcd_bg_color(s, i);
+        }
+        s->batch_bg_colors = s->bg_colors;
+        i = 0;
+
+        for (y = s->batch_start; y < end; y++) {
+            for (; (i < s->log_count) && (s->log[i].line < y); i++) {
+                LCD_REG(s->frame_regs, s->log[i].offset) = s->log[i].value;
+                gba_lcd_ref_written(s, s->log[i].offset);
+            }
+
+            gba_lcd_draw_line(s, s->frame_regs, y);
+        }
+
+        s->batch_bg_colors = NULL;
+    }
+
+    // Writes from the last line take effect on the next one
+    for (; i < s->log_count; i++) {
+        gba_lcd_ref_written(s, s->log[i].offset);
+    }
+
+    if (dirty) {
+        s->palette = palette;
+        s->vram    = vram;
+        s->oam     = oam;
+        s->defer_frame = false;
+    }
+
+    gba_lcd_check_dirty(s);
+
+    memcpy(s->frame_regs, ((gba_io_state *)s->io)->regs,
+           sizeof(s->frame_regs));
+    s->log_count = 0;
+    s->batch_start = end;
+}
+
+
+static void gba_lcd_start_frame(gba_lcd_state *s)
+{
+    s->defer_frame = s->deferred && !s->defer_holdoff;
+    s->batch_start = 0;
+    s->log_count = 0;
+    s->hash_acc = 2166136261u;
+    s->update_first = GBA_LCD_HEIGHT;
+    s->update_last = -1;
+
+    memcpy(s->frame_regs, ((gba_io_state *)s->io)->regs,
+           sizeof(s->frame_regs));
+
+    if (s->defer_frame) {
+        memcpy(s->frame_palette, s->palette, GBA_PALETTE_SIZE);
+        memcpy(s->frame_vram, s->vram, GBA_VRAM_SIZE);
+        memcpy(s->frame_oam, s->oam, GBA_OAM_SIZE);
+    }
+}
+
+static void gba_lcd_end_frame(gba_lcd_state *s)
+{
+    if (s->defer_frame) {
+        gba_lcd_flush(s, GBA_LCD_HEIGHT);
     }
 
+    if (s->deferred) {
+        if (s->line_epoch[0] != s->line_epoch[GBA_LCD_HEIGHT - 1]) {
+            s->defer_holdoff = GBA_LCD_DEFER_HOLDOFF;
+        } else if (s->defer_holdoff) {
+            s->defer_holdoff--;
+        }
+    }
+
+    // Of shared surfaces, only the lines that have changed are reported
+    if (!is_buffer_shared(qemu_console_surface(s->con))) {
+        dpy_gfx_update(s->con, 0, 0, GBA_LCD_WIDTH, GBA_LCD_HEIGHT);
+    } else if (s->update_first <= s->update_last) {
+        dpy_gfx_update(s->con, 0, s->update_first, GBA_LCD_WIDTH,
+                       s->update_last - s->update_first + 1);
+    }
+
+    s->frame_hash = s->hash_acc;
+    qemu_irq_pulse(s->irq_frame);
+}
+
+static void gba_lcd_start_line(gba_lcd_state *s)
+{
+    // Memory changes must not affect the lines pending already (including
+    // changes made during the last line, which are checked at VBlank)
+    if (s->defer_frame && s->ly && (s->ly <= GBA_LCD_HEIGHT) &&
+        gba_lcd_memory_dirty(s))
+    {
+        gba_lcd_flush(s, s->ly);
+    }
+
+    gba_lcd_check_dirty(s);
+
+    if (!s->ly) {
+        gba_lcd_start_frame(s);
+    }
+
+    if (s->ly < GBA_LCD_HEIGHT) {
+        s->line_epoch[s->ly] = s->epoch;
 
-    if (s->ly == 159) {
-        dpy_gfx_update(s->con, 0, 0, 240, 160);
+        if (!s->defer_frame) {
+            gba_lcd_draw_line(s, ((gba_io_state *)s->io)->regs, s->ly);
+        }
+    } else if (s->ly == GBA_LCD_HEIGHT) {
+        gba_lcd_end_frame(s);
     }
 }
 
@@ -75,104 +1590,101 @@ static void gba_lcd_invalidate_display(void *opaque)
 }
 
 
-#define CHECK_WIDTH_MAX(expected) \
-    if (size > expected) { \
-        printf("%s: Bad access size %u (on register 0x%x)\n", \
-               __func__, size, (int)offset); \
-    }
+static void gba_lcd_update_status(gba_lcd_state *s)
+{
+    // DISPSTAT and VCOUNT are polled a lot, so keep them current in the I/O
+    // register file instead of computing them on every read
+    gba_io_set(s->io, 0x04,
+               ((int)((s->ly >= 160) && (s->ly <= 226))) // V-Blank
+             | ((int)s->hblank          << 1)            // H-Blank
+             | ((int)(s->ly == s->lyc)  << 2)            // V-Counter match
+             | ((int)s->irq_vb_en       << 3)            // VB IRQ enable
+             | ((int)s->irq_hb_en       << 4)            // HB IRQ enable
+             | ((int)s->irq_vm_en       << 5)            // VCM IRQ enable
+             | (s->lyc                  << 8));          // V-Counter
+
+    gba_io_set(s->io, 0x06, s->ly); // Current scan line
+}
+
 
-static uint64_t gba_lcd_read(void *opaque, hwaddr offset, unsigned size)
+static void gba_lcd_write(void *opaque, hwaddr offset, uint16_t value,
+                          uint16_t mask)
 {
     gba_lcd_state *s = (gba_lcd_state *)opaque;
 
     switch (offset)
     {
-        case 0x00: // DISPCNT
-            CHECK_WIDTH_MAX(4);
-            return s->bg_mode
-                 | (s->bgm_45_frame     <<  4)
-                 | (s->hb_intvl_free    <<  5)
-                 | (!s->obj_vram_map_2d <<  6)
-                 | (s->forced_blank     <<  7)
-                 | (s->display_bg[0]    <<  8)
-                 | (s->display_bg[1]    <<  9)
-                 | (s->display_bg[2]    << 10)
-                 | (s->display_bg[3]    << 11)
-                 | (s->display_obj      << 12)
-                 | (s->display_wnd[0]   << 13)
-                 | (s->display_wnd[1]   << 14)
-                 | (s->display_ownd     << 15);
-
         case 0x04: // DISPSTAT
-            CHECK_WIDTH_MAX(2);
-            return ((int)((s->ly >= 160) && (s->ly <= 226))) // V-Blank
-                 | ((int)s->hblank          << 1)            // H-Blank
-                 | ((int)(s->ly == s->lyc)  << 2)            // V-Counter match
-                 | ((int)s->irq_vb_en       << 3)            // VB IRQ enable
-                 | ((int)s->irq_hb_en       << 4)            // HB IRQ enable
-                 | ((int)s->irq_vm_en       << 5)            // VCM IRQ enable
-                 | (s->lyc                  << 8);           // V-Counter
+            if (mask & 0x00ff) {
+                s->irq_vb_en = (value >> 3) & 1;
+                s->irq_hb_en = (value >> 4) & 1;
+                s->irq_vm_en = (value >> 5) & 1;
+            }
+            if (mask & 0xff00) {
+                s->lyc = value >> 8;
+            }
+            gba_lcd_update_status(s);
+            break;
 
         case 0x06: // VCOUNT
-            CHECK_WIDTH_MAX(2);
-            return s->ly; // Current scan line
-
-        default:
-            printf("gba_lcd_read: Bad register offset 0x%x\n", (int)offset);
-            return 0;
+            break;
     }
 }
 
-static void gba_lcd_write(void *opaque, hwaddr offset, uint64_t value,
-                          unsigned size)
+/* Write handler for the BG2/BG3 reference points */
+static void gba_lcd_write_ref(void *opaque, hwaddr offset, uint16_t value,
+                              uint16_t mask)
 {
     gba_lcd_state *s = (gba_lcd_state *)opaque;
 
-    switch (offset)
-    {
-        case 0x00: // DISPCNT
-            CHECK_WIDTH_MAX(4);
-            s->bg_mode          =    value        & 7;
-            s->bgm_45_frame     =   (value >>  4) & 1;
-            s->hb_intvl_free    =   (value >>  5) & 1;
-            s->obj_vram_map_2d  = !((value >>  6) & 1);
-            s->forced_blank     =   (value >>  7) & 1;
-            s->display_bg[0]    =   (value >>  8) & 1;
-            s->display_bg[1]    =   (value >>  9) & 1;
-            s->display_bg[2]    =   (value >> 10) & 1;
-            s->display_bg[3]    =   (value >> 11) & 1;
-            s->display_obj      =   (value >> 12) & 1;
-            s->display_wnd[0]   =   (value >> 13) & 1;
-            s->display_wnd[1]   =   (value >> 14) & 1;
-            s->display_ownd     =   (value >> 15) & 1;
-            break;
+    gba_io_set(s->io, offset, gba_io_merge(s->io, offset, value, mask));
+    gba_lcd_ref_written(s, offset);
+}
 
-        case 0x04: // DISPSTAT
-            CHECK_WIDTH_MAX(4);
-            s->irq_vb_en = (value >> 3) & 1;
-            s->irq_hb_en = (value >> 4) & 1;
-            s->irq_vm_en = (value >> 5) & 1;
-            if (size == 1) {
-                break;
-            }
-            value >>= 8;
-            size--;
+/* Write handler for all other registers in deferred rendering mode */
+static void gba_lcd_write_logged(void *opaque, hwaddr offset, uint16_t value,
+                                 uint16_t mask)
+{
+    gba_lcd_state *s = (gba_lcd_state *)opaque;
 
-        case 0x05: // DISPSTAT.LYC
-            CHECK_WIDTH_MAX(3);
-            s->lyc = value;
+    // Rewriting a reference point is not a no-op
+    value = gba_io_merge(s->io, offset, value, mask);
+    if ((value == gba_io_get(s->io, offset)) &&
+        (gba_lcd_ref_index(offset) < 0))
+    {
+        return;
+    }
 
-        case 0x06: // VCOUNT
-            break;
+    gba_io_set(s->io, offset, value);
 
-        default:
-            printf("gba_lcd_write: Bad register offset 0x%x (tried to write "
-                   "0x%0*" PRIx64 ")\n", (int)offset, size * 2, value);
-            return;
+    if (!s->defer_frame || (s->ly >= GBA_LCD_HEIGHT)) {
+        gba_lcd_ref_written(s, offset);
+        return;
+    }
+
+    if (s->log_count < GBA_LCD_LOG_SIZE) {
+        s->log[s->log_count++] = (gba_lcd_reg_write){
+            .line   = s->ly,
+            .offset = offset,
+            .value  = value,
+        };
+    } else {
+        // Log is full, so render everything up to this line right now
+        gba_lcd_flush(s, s->ly + 1);
+        gba_lcd_ref_written(s, offset);
     }
 }
 
 
+/* The PIC latches on rising edges, so only changes need to be signalled */
+static void gba_lcd_set_irq(qemu_irq irq, bool *current, bool level)
+{
+    if (level != *current) {
+        *current = level;
+        qemu_set_irq(irq, level);
+    }
+}
+
 static void gba_lcd_timer(void *opaque)
 {
     gba_lcd_state *s = (gba_lcd_state *)opaque;
@@ -183,36 +1695,205 @@ static void gba_lcd_timer(void *opaque)
             s->ly = 0;
         }
 
-        qemu_set_irq(s->irq_vb, s->irq_vb_en && (s->ly >= 160));
-        qemu_set_irq(s->irq_vm, s->irq_vm_en && (s->ly == s->lyc));
+        gba_lcd_set_irq(s->irq_vb, &s->irq_vb_level,
+                        s->irq_vb_en && (s->ly >= 160));
+        gba_lcd_set_irq(s->irq_vm, &s->irq_vm_level,
+                        s->irq_vm_en && (s->ly == s->lyc));
     }
 
     s->hblank = !s->hblank;
-    qemu_set_irq(s->irq_hb, s->irq_hb_en && s->hblank);
+    gba_lcd_set_irq(s->irq_hb, &s->irq_hb_level, s->irq_hb_en && s->hblank);
+
+    gba_lcd_update_status(s);
 
     if (!s->hblank) {
-        gba_lcd_update_current_line(s);
+        gba_lcd_start_line(s);
+    }
+
+
+    if (!s->next_call) {
+        s->next_call = qemu_get_clock_ns(vm_clock);
+    }
+
+    s->next_call += (s->hblank ? 16212 : 57221);
+
+    qemu_mod_timer_ns(s->timer, s->next_call);
+}
+
+
+static void gba_lcd_get_counter(Object *obj, Visitor *v, void *opaque,
+                                const char *name, Error **errp)
+{
+    visit_type_uint64(v, (uint64_t *)opaque, name, errp);
+}
+
+static void gba_lcd_get_hash(Object *obj, Visitor *v, void *opaque,
+                             const char *name, Error **errp)
+{
+    visit_type_uint32(v, (uint32_t *)opaque, name, errp);
+}
+
+
+/* For when memory has been changed behind the dirty log's back */
+static void gba_lcd_invalidate_caches(gba_lcd_state *s)
+{
+    int i;
+
+    for (i = 0; i < GBA_VRAM_BLOCKS; i++) {
+        s->vram_gen[i]++;
+    }
+    s->epoch++;
+}
+
+static void gba_lcd_reset(DeviceState *dev)
+{
+    gba_lcd_state *s = FROM_SYSBUS(gba_lcd_state, SYS_BUS_DEVICE(dev));
+
+    s->irq_vb_en = s->irq_hb_en = s->irq_vm_en = false;
+    s->irq_vb_level = s->irq_hb_level = s->irq_vm_level = false;
+    s->lyc = 0;
+
+    s->defer_frame = false;
+    s->defer_holdoff = 0;
+    s->log_count = 0;
+    s->bg_ref_reload = 0;
+
+    // The machine reset may have cleared VRAM without the dirty log noticing
+    gba_lcd_invalidate_caches(s);
+
+    // Let the next timer event start the first line of a new frame
+    s->ly = 227;
+    s->hblank = true;
+    s->next_call = qemu_get_clock_ns(vm_clock);
+    qemu_mod_timer_ns(s->timer, s->next_call);
+
+    gba_lcd_update_status(s);
+}
+
+
+/*
+ * Saving and loading have no effect on rendering: A deferred frame in progress
+ * is saved as it is (register log, memory copy, epochs and whether the memory
+ * has been modified since it was last checked) and continues after loading as
+ * if nothing had happened.
+ */
+static void gba_lcd_pre_save(void *opaque)
+{
+    gba_lcd_state *s = (gba_lcd_state *)opaque;
+
+    s->memory_dirty = gba_lcd_memory_dirty(s);
+}
+
+static int gba_lcd_post_load(void *opaque, int version_id)
+{
+    gba_lcd_state *s = (gba_lcd_state *)opaque;
+    MemoryRegion *mrs[] = { s->vram_mr, s->palette_mr, s->oam_mr };
+    int i;
+
+    if ((s->log_count < 0) || (s->log_count > GBA_LCD_LOG_SIZE) ||
+        (s->batch_start < 0) || (s->batch_start > GBA_LCD_HEIGHT))
+    {
+        return -EINVAL;
     }
 
+    // Loading the memory does not count as a modification by itself, only
+    // modifications that had not been picked up when saving do; cached tiles
+    // are checked against the loaded memory either way
+    for (i = 0; i < ARRAY_SIZE(mrs); i++) {
+        memory_region_reset_dirty(mrs[i], 0, memory_region_size(mrs[i]),
+                                  DIRTY_MEMORY_VGA);
+    }
+    if (s->memory_dirty) {
+        memory_region_set_dirty(s->vram_mr, 0, GBA_VRAM_SIZE);
+    }
+    for (i = 0; i < GBA_VRAM_BLOCKS; i++) {
+        s->vram_gen[i]++;
+    }
+    s->invalidate = true;
+    s->update_first = 0;
+    s->update_last = GBA_LCD_HEIGHT - 1;
 
-    static uint64_t next_call = 0;
+    return 0;
+}
 
-    if (!next_call) {
-        next_call = qemu_get_clock_ns(vm_clock);
+static const VMStateDescription gba_lcd_reg_write_vmstate = {
+    .name = "gba_lcd_reg_write",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(line, gba_lcd_reg_write),
+        VMSTATE_UINT8(offset, gba_lcd_reg_write),
+        VMSTATE_UINT16(value, gba_lcd_reg_write),
+        VMSTATE_END_OF_LIST()
     }
+};
 
-    next_call += (s->hblank ? 16212 : 57221);
+// The memory copy is only of use while a deferred frame has pending lines
+static bool gba_lcd_frame_copy_needed(void *opaque)
+{
+    gba_lcd_state *s = (gba_lcd_state *)opaque;
 
-    qemu_mod_timer_ns(s->timer, next_call);
+    return s->defer_frame && (s->batch_start < GBA_LCD_HEIGHT);
 }
 
+static const VMStateDescription gba_lcd_frame_copy_vmstate = {
+    .name = "gba_lcd/frame_copy",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(frame_palette, gba_lcd_state, GBA_PALETTE_SIZE),
+        VMSTATE_UINT8_ARRAY(frame_vram, gba_lcd_state, GBA_VRAM_SIZE),
+        VMSTATE_UINT8_ARRAY(frame_oam, gba_lcd_state, GBA_OAM_SIZE),
+        VMSTATE_END_OF_LIST()
+    }
+};
 
-static const MemoryRegionOps gba_lcd_ops = {
-    .read = gba_lcd_read,
-    .write = gba_lcd_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
+static const VMStateDescription gba_lcd_vmstate = {
+    .name = "gba_lcd",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = gba_lcd_pre_save,
+    .post_load = gba_lcd_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER(timer, gba_lcd_state),
+        VMSTATE_UINT64(next_call, gba_lcd_state),
+        VMSTATE_BOOL(hblank, gba_lcd_state),
+        VMSTATE_INT32(ly, gba_lcd_state),
+        VMSTATE_INT32(lyc, gba_lcd_state),
+        VMSTATE_BOOL(irq_vb_en, gba_lcd_state),
+        VMSTATE_BOOL(irq_hb_en, gba_lcd_state),
+        VMSTATE_BOOL(irq_vm_en, gba_lcd_state),
+        VMSTATE_BOOL(irq_vb_level, gba_lcd_state),
+        VMSTATE_BOOL(irq_hb_level, gba_lcd_state),
+        VMSTATE_BOOL(irq_vm_level, gba_lcd_state),
+        VMSTATE_BOOL(defer_frame, gba_lcd_state),
+        VMSTATE_BOOL(memory_dirty, gba_lcd_state),
+        VMSTATE_INT32(defer_holdoff, gba_lcd_state),
+        VMSTATE_INT32(batch_start, gba_lcd_state),
+        VMSTATE_UINT16_ARRAY(frame_regs, gba_lcd_state, 0x30),
+        VMSTATE_STRUCT_ARRAY(log, gba_lcd_state, GBA_LCD_LOG_SIZE, 0,
+                             gba_lcd_reg_write_vmstate, gba_lcd_reg_write),
+        VMSTATE_INT32(log_count, gba_lcd_state),
+        VMSTATE_UINT32(epoch, gba_lcd_state),
+        VMSTATE_UINT32_ARRAY(line_epoch, gba_lcd_state, GBA_LCD_HEIGHT),
+        VMSTATE_UINT32(hash_acc, gba_lcd_state),
+        VMSTATE_UINT32(frame_hash, gba_lcd_state),
+        VMSTATE_INT32_ARRAY(bg_ref, gba_lcd_state, 4),
+        VMSTATE_INT32_ARRAY(bg_mosaic_ref, gba_lcd_state, 4),
+        VMSTATE_UINT8(bg_ref_reload, gba_lcd_state),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &gba_lcd_frame_copy_vmstate,
+            .needed = gba_lcd_frame_copy_needed,
+        }, {
+            /* empty */
+        }
+    }
 };
 
+
 static const GraphicHwOps gba_lcd_gfx_ops = {
     .invalidate = gba_lcd_invalidate_display,
     .gfx_update = gba_lcd_update_display,
@@ -222,13 +1903,42 @@ static int gba_lcd_init(SysBusDevice *dev)
 {
     gba_lcd_state *s = FROM_SYSBUS(gba_lcd_state, dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_lcd_ops, s, "gba-lcd",
-                          0x00000060);
-    sysbus_init_mmio(dev, &s->iomem);
+    // The renderer reads everything but DISPSTAT/VCOUNT from the register file
+    gba_io_register(s->io, 0x00, 0x60, NULL,
+                    s->deferred ? gba_lcd_write_logged : NULL, s);
+    if (!s->deferred) {
+        gba_io_register(s->io, 0x28, 0x08, NULL, gba_lcd_write_ref, s);
+        gba_io_register(s->io, 0x38, 0x08, NULL, gba_lcd_write_ref, s);
+    }
+    gba_io_register(s->io, 0x04, 0x04, NULL, gba_lcd_write, s);
+    gba_io_set_pollable(s->io, 0x04, 0x04);
 
     sysbus_init_irq(dev, &s->irq_vb);
     sysbus_init_irq(dev, &s->irq_hb);
     sysbus_init_irq(dev, &s->irq_vm);
+    sysbus_init_irq(dev, &s->irq_frame);
+
+    s->palette = memory_region_get_ram_ptr(s->palette_mr);
+    s->vram    = memory_region_get_ram_ptr(s->vram_mr);
+    s->oam     = memory_region_get_ram_ptr(s->oam_mr);
+
+    memory_region_set_log(s->vram_mr, true, DIRTY_MEMORY_VGA);
+    if (s->deferred) {
+        memory_region_set_log(s->palette_mr, true, DIRTY_MEMORY_VGA);
+        memory_region_set_log(s->oam_mr,     true, DIRTY_MEMORY_VGA);
+    }
+
+    s->tiles = g_new0(gba_tile_entry, GBA_TILE_CACHE_SLOTS);
+    s->pixel_lut = g_new(uint32_t, 0x8000);
+    s->shadow = g_new0(uint32_t, GBA_LCD_WIDTH * GBA_LCD_HEIGHT);
+
+    object_property_add(OBJECT(s), "tile-cache-hits", "uint64",
+                        gba_lcd_get_counter, NULL, NULL, &s->tile_hits, NULL);
+    object_property_add(OBJECT(s), "tile-cache-misses", "uint64",
+                        gba_lcd_get_counter, NULL, NULL, &s->tile_misses,
+                        NULL);
+    object_property_add(OBJECT(s), "frame-hash", "uint32",
+                        gba_lcd_get_hash, NULL, NULL, &s->frame_hash, NULL);
 
     s->con = graphic_console_init(DEVICE(dev), &gba_lcd_gfx_ops, s);
     qemu_console_resize(s->con, 240, 160);
@@ -240,11 +1950,24 @@ static int gba_lcd_init(SysBusDevice *dev)
 }
 
 
+static Property gba_lcd_properties[] = {
+    DEFINE_PROP_PTR("io", gba_lcd_state, io),
+    DEFINE_PROP_PTR("palette", gba_lcd_state, palette_mr),
+    DEFINE_PROP_PTR("vram", gba_lcd_state, vram_mr),
+    DEFINE_PROP_PTR("oam", gba_lcd_state, oam_mr),
+    DEFINE_PROP_BOOL("deferred", gba_lcd_state, deferred, false),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void gba_lcd_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_lcd_init;
+    dc->props = gba_lcd_properties;
+    dc->vmsd = &gba_lcd_vmstate;
+    dc->reset = gba_lcd_reset;
 }
 
 static const TypeInfo gba_lcd_info = {
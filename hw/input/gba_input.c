@@ -1,53 +1,84 @@
 #include "hw/sysbus.h"
+#include "hw/arm/gba.h"
 
 
+#define GBA_KEYS 10
+
 typedef struct gba_input_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
+    void *io;
     qemu_irq irq;
+    uint16_t pressed;
 } gba_input_state;
 
 
-static uint64_t gba_input_read(void *opaque, hwaddr offset, unsigned size)
+/*
+ * Keys are GPIO inputs (high = pressed, in KEYINPUT bit order), so anything
+ * can feed key presses into the machine, e.g. the batch runner. KEYINPUT
+ * (active low) is kept up to date in the register file, so idle loop
+ * detection can catch guests busy-waiting for a key press. KEYCNT is stored,
+ * but keypad interrupts are not emulated yet.
+ */
+
+static void gba_input_set_key(void *opaque, int key, int level)
 {
-    printf("gba_input_read: Bad register offset 0x%x\n", (int)offset);
-    return 0;
+    gba_input_state *s = (gba_input_state *)opaque;
+
+    if (level) {
+        s->pressed |=   1 << key;
+    } else {
+        s->pressed &= ~(1 << key);
+    }
+
+    gba_io_set(s->io, 0x130, ~s->pressed & 0x03ff);
 }
 
-static void gba_input_write(void *opaque, hwaddr offset, uint64_t value,
-                            unsigned size)
+static void gba_input_write(void *opaque, hwaddr offset, uint16_t value,
+                            uint16_t mask)
 {
-    printf("gba_input_write: Bad register offset 0x%x (tried to write 0x%0*"
-           PRIx64 ")\n", (int)offset, size * 2, value);
+    // KEYINPUT is read-only
 }
 
 
-static const MemoryRegionOps gba_input_ops = {
-    .read = gba_input_read,
-    .write = gba_input_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+static void gba_input_reset(DeviceState *dev)
+{
+    gba_input_state *s = FROM_SYSBUS(gba_input_state, SYS_BUS_DEVICE(dev));
 
+    // A reset does not release any keys
+    gba_io_set(s->io, 0x130, ~s->pressed & 0x03ff);
+    gba_io_set(s->io, 0x132, 0x0000);
+}
 
 static int gba_input_init(SysBusDevice *dev)
 {
     gba_input_state *s = FROM_SYSBUS(gba_input_state, dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_input_ops, s, "gba-input",
-                          0x00000004);
-    sysbus_init_mmio(dev, &s->iomem);
+    gba_io_register(s->io, 0x130, 0x02, NULL, gba_input_write, s);
+    gba_io_register(s->io, 0x132, 0x02, NULL, NULL, s);
+    gba_io_set_pollable(s->io, 0x130, 0x02);
 
+    qdev_init_gpio_in(&dev->qdev, gba_input_set_key, GBA_KEYS);
     sysbus_init_irq(dev, &s->irq);
 
+    gba_input_reset(DEVICE(dev));
+
     return 0;
 }
 
 
+static Property gba_input_properties[] = {
+    DEFINE_PROP_PTR("io", gba_input_state, io),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void gba_input_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_input_init;
+    dc->props = gba_input_properties;
+    dc->reset = gba_input_reset;
 }
 
 static const TypeInfo gba_input_info = {
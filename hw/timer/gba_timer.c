@@ -1,41 +1,33 @@
 #include "hw/sysbus.h"
+#include "hw/arm/gba.h"
 
 
 typedef struct gba_timer_state {
     SysBusDevice busdev;
-    MemoryRegion iomem;
+    void *io;
     qemu_irq irq[4];
 } gba_timer_state;
 
 
-static uint64_t gba_timer_read(void *opaque, hwaddr offset, unsigned size)
+static uint16_t gba_timer_read(void *opaque, hwaddr offset)
 {
     printf("gba_timer_read: Bad register offset 0x%x\n", (int)offset);
     return 0;
 }
 
-static void gba_timer_write(void *opaque, hwaddr offset, uint64_t value,
-                            unsigned size)
+static void gba_timer_write(void *opaque, hwaddr offset, uint16_t value,
+                            uint16_t mask)
 {
-    printf("gba_timer_write: Bad register offset 0x%x (tried to write 0x%0*"
-           PRIx64 ")\n", (int)offset, size * 2, value);
+    printf("gba_timer_write: Bad register offset 0x%x (tried to write 0x%04x, "
+           "mask 0x%04x)\n", (int)offset, value, mask);
 }
 
 
-static const MemoryRegionOps gba_timer_ops = {
-    .read = gba_timer_read,
-    .write = gba_timer_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
-
-
 static int gba_timer_init(SysBusDevice *dev)
 {
     gba_timer_state *s = FROM_SYSBUS(gba_timer_state, dev);
 
-    memory_region_init_io(&s->iomem, OBJECT(s), &gba_timer_ops, s, "gba-timer",
-                          0x00000004);
-    sysbus_init_mmio(dev, &s->iomem);
+    gba_io_register(s->io, 0x100, 0x04, gba_timer_read, gba_timer_write, s);
 
     sysbus_init_irq(dev, &s->irq[0]);
     sysbus_init_irq(dev, &s->irq[1]);
@@ -46,11 +38,18 @@ static int gba_timer_init(SysBusDevice *dev)
 }
 
 
+static Property gba_timer_properties[] = {
+    DEFINE_PROP_PTR("io", gba_timer_state, io),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void gba_timer_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     SysBusDeviceClass *sdc = SYS_BUS_DEVICE_CLASS(klass);
 
     sdc->init = gba_timer_init;
+    dc->props = gba_timer_properties;
 }
 
 static const TypeInfo gba_timer_info = {
@@ -0,0 +1,98 @@
+#ifndef HW_ARM_GBA_H
+#define HW_ARM_GBA_H
+
+#include "hw/sysbus.h"
+
+
+/*
+ * The whole I/O space (0x04000000 - 0x040003ff) is one flat array of 16 bit
+ * registers. Devices register handlers per halfword; halfwords without a read
+ * handler are served straight from the array, halfwords without a write
+ * handler are plain storage. Handlers always see aligned halfword offsets
+ * relative to 0x04000000; the mask tells which bytes are actually written.
+ *
+ * Registers marked as pollable are ones guests like to busy-wait on. They must
+ * not have a read handler and have to be updated through gba_io_set(), which
+ * allows the I/O core to put the CPU to sleep while it is polling them (if
+ * idle loop detection is enabled).
+ */
+
+#define GBA_CPU_FREQ 16777216
+
+#define GBA_IO_SIZE 0x400
+#define GBA_IO_REGS (GBA_IO_SIZE / 2)
+
+typedef uint16_t (*gba_io_read_fn)(void *opaque, hwaddr offset);
+typedef void (*gba_io_write_fn)(void *opaque, hwaddr offset, uint16_t value,
+                                uint16_t mask);
+
+typedef struct gba_io_handler {
+    gba_io_read_fn read;
+    gba_io_write_fn write;
+    void *opaque;
+    bool mapped;
+    bool pollable;
+} gba_io_handler;
+
+typedef struct gba_io_state {
+    SysBusDevice busdev;
+    MemoryRegion iomem;
+    void *cpu;
+    uint16_t regs[GBA_IO_REGS];
+    gba_io_handler handlers[GBA_IO_REGS];
+
+    bool idle_detect;
+    bool fast_forward;
+    bool idle;
+    hwaddr poll_offset;
+    unsigned poll_size, poll_count;
+    uint64_t poll_value;
+    void (*idle_check)(struct gba_io_state *io);
+} gba_io_state;
+
+
+static inline void gba_io_register(gba_io_state *io, hwaddr offset,
+                                   hwaddr size, gba_io_read_fn read,
+                                   gba_io_write_fn write, void *opaque)
+{
+    unsigned i;
+    for (i = offset >> 1; i < (offset + size + 1) >> 1; i++) {
+        io->handlers[i] = (gba_io_handler){
+            .read   = read,
+            .write  = write,
+            .opaque = opaque,
+            .mapped = true,
+        };
+    }
+}
+
+static inline void gba_io_set_pollable(gba_io_state *io, hwaddr offset,
+                                       hwaddr size)
+{
+    unsigned i;
+    for (i = offset >> 1; i < (offset + size + 1) >> 1; i++) {
+        io->handlers[i].pollable = true;
+    }
+}
+
+static inline uint16_t gba_io_get(gba_io_state *io, hwaddr offset)
+{
+    return io->regs[offset >> 1];
+}
+
+static inline void gba_io_set(gba_io_state *io, hwaddr offset, uint16_t value)
+{
+    io->regs[offset >> 1] = value;
+
+    if (unlikely(io->idle)) {
+        io->idle_check(io);
+    }
+}
+
+static inline uint16_t gba_io_merge(gba_io_state *io, hwaddr offset,
+                                    uint16_t value, uint16_t mask)
+{
+    return (io->regs[offset >> 1] & ~mask) | (value & mask);
+}
+
+#endif